@@ -0,0 +1,624 @@
+/*
+ * Throughput benchmark for the file encryption engine
+ * Measures the XOR kernels across key lengths and buffer sizes (keyed and
+ * generic for the key lengths with keyed kernels), every AEAD
+ * implementation on whole chunks, every BLAKE3 chunk hasher, and end-to-end
+ * file processing for each backend (the GPU one when an OpenCL GPU is
+ * present) on tmpfs and on disk.
+ * Results are written as JSON so runs can be compared between releases.
+ */
+
+#include "file_encrypt_internal.h"
+
+#include <time.h>
+
+#if defined(FE_ARCH_X86) && !defined(_MSC_VER)
+#include <x86intrin.h>
+#endif
+
+#define BENCH_MIN_SECONDS 0.25
+#define BENCH_QUICK_MIN_SECONDS 0.05
+#define BENCH_DEFAULT_FILE_MB 256
+#define BENCH_QUICK_FILE_MB 32
+
+/*
+ * Benchmark settings from the command line
+ */
+typedef struct {
+    const char *outputPath;
+    const char *tmpfsDir;
+    const char *diskDir;
+    int fileMegabytes;
+    int threads;
+    int quick;
+    int skipFiles;
+} BenchConfig;
+
+/*
+ * One measurement, as written to the JSON output
+ */
+typedef struct {
+    const char *bench;
+    const char *kernel;
+    const char *backend;
+    const char *location;
+    int keyLen;
+    size_t bufferSize;
+    int threads;
+    uint64_t bytes;
+    double seconds;
+    uint64_t cycles;
+} BenchResult;
+
+static FILE *jsonOut;
+static int resultCount = 0;
+
+/*
+ * Monotonic wall clock in seconds
+ */
+static double nowSeconds() {
+#ifdef _WIN32
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+/*
+ * Time stamp counter, or 0 where there is none
+ */
+static uint64_t readCycles() {
+#if defined(FE_ARCH_X86)
+    return (uint64_t)__rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Append one result object to the JSON output
+ */
+static void emitResult(const BenchResult *r) {
+    double gbps = r->seconds > 0 ? (double)r->bytes / r->seconds / 1e9 : 0.0;
+
+    fprintf(jsonOut, "%s\n    {\"bench\": \"%s\"", resultCount++ > 0 ? "," : "", r->bench);
+    if (r->kernel != NULL) {
+        fprintf(jsonOut, ", \"kernel\": \"%s\"", r->kernel);
+    }
+    if (r->backend != NULL) {
+        fprintf(jsonOut, ", \"backend\": \"%s\"", r->backend);
+    }
+    if (r->location != NULL) {
+        fprintf(jsonOut, ", \"location\": \"%s\"", r->location);
+    }
+    if (r->keyLen > 0) {
+        fprintf(jsonOut, ", \"key_len\": %d", r->keyLen);
+    }
+    if (r->bufferSize > 0) {
+        fprintf(jsonOut, ", \"buffer_size\": %lu", (unsigned long)r->bufferSize);
+    }
+    fprintf(jsonOut, ", \"threads\": %d, \"bytes\": %llu, \"seconds\": %.6f, \"gb_per_s\": %.3f",
+            r->threads, (unsigned long long)r->bytes, r->seconds, gbps);
+    if (r->cycles > 0 && r->bytes > 0) {
+        fprintf(jsonOut, ", \"cycles_per_byte\": %.4f", (double)r->cycles / (double)r->bytes);
+    } else {
+        fprintf(jsonOut, ", \"cycles_per_byte\": null");
+    }
+    fprintf(jsonOut, "}");
+    fflush(jsonOut);
+}
+
+/*
+ * Fill a buffer with cheap pseudo-random bytes
+ */
+static void fillRandom(unsigned char *data, size_t len, uint64_t seed) {
+    uint64_t x = seed | 1;
+    for (size_t i = 0; i < len; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        data[i] = (unsigned char)x;
+    }
+}
+
+/*
+ * Time the active XOR kernel on one key length and buffer size
+ * The buffer is processed repeatedly, at advancing stream offsets, until
+ * the minimum run time has passed. generic forces the period loop on a
+ * key length that has a keyed kernel.
+ */
+static void benchXor(const BenchConfig *config, const char *kernel, int keyLen, size_t bufferSize,
+                     unsigned char *buffer, int generic) {
+    double minSeconds = config->quick ? BENCH_QUICK_MIN_SECONDS : BENCH_MIN_SECONDS;
+    char key[MAX_KEY_LENGTH];
+    KeyStream *keyStream = (KeyStream *)malloc(sizeof(KeyStream));
+    BenchResult result;
+    uint64_t offset = 0;
+    double start;
+    uint64_t startCycles;
+
+    if (keyStream == NULL) {
+        return;
+    }
+    fillRandom((unsigned char *)key, (size_t)keyLen, (uint64_t)keyLen);
+    keyStreamInit(keyStream, key, (size_t)keyLen);
+    if (generic) {
+        keyStream->keyedSlot = -1;
+    }
+
+    // Warm up caches and page in the buffer
+    keyStreamApplyAt(keyStream, CIPHER_MODE_CONTINUOUS_V2, buffer, buffer, bufferSize, 0);
+
+    start = nowSeconds();
+    startCycles = readCycles();
+    do {
+        keyStreamApplyAt(keyStream, CIPHER_MODE_CONTINUOUS_V2, buffer, buffer, bufferSize, offset);
+        offset += bufferSize;
+    } while (nowSeconds() - start < minSeconds);
+
+    memset(&result, 0, sizeof(result));
+    result.bench = "xor";
+    result.kernel = kernel;
+    result.keyLen = keyLen;
+    result.bufferSize = bufferSize;
+    result.threads = 1;
+    result.bytes = offset;
+    result.cycles = readCycles() - startCycles;
+    result.seconds = nowSeconds() - start;
+    emitResult(&result);
+    free(keyStream);
+}
+
+/*
+ * Run the kernel matrix for every kernel this CPU supports
+ */
+static void benchKernels(const BenchConfig *config) {
+    static const int keyLengths[] = { 4, 7, 8, 13, 16, 31, 32, 64, 100, 127 };
+    static const size_t bufferSizes[] = { 4096, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+    size_t maxBuffer = bufferSizes[sizeof(bufferSizes) / sizeof(bufferSizes[0]) - 1];
+    unsigned char *buffer = (unsigned char *)malloc(maxBuffer);
+
+    if (buffer == NULL) {
+        fprintf(stderr, "bench: out of memory\n");
+        return;
+    }
+    fillRandom(buffer, maxBuffer, 42);
+
+    for (size_t k = 0; k < xorKernelCount; k++) {
+        if (useXorKernel(xorKernels[k].name) != 0) {
+            continue;
+        }
+        for (size_t b = 0; b < sizeof(bufferSizes) / sizeof(bufferSizes[0]); b++) {
+            if (config->quick && bufferSizes[b] > 1024 * 1024) {
+                continue;
+            }
+            for (size_t i = 0; i < sizeof(keyLengths) / sizeof(keyLengths[0]); i++) {
+                char generic[32];
+                benchXor(config, xorKernels[k].name, keyLengths[i], bufferSizes[b], buffer, 0);
+                // The same lengths through the period loop, for comparison
+                if (xorKeyedSlot((size_t)keyLengths[i]) >= 0) {
+                    snprintf(generic, sizeof(generic), "%s-generic", xorKernels[k].name);
+                    benchXor(config, generic, keyLengths[i], bufferSizes[b], buffer, 1);
+                }
+            }
+        }
+    }
+
+    // Back to the automatic choice for the file benchmarks
+    useXorKernel(NULL);
+    free(buffer);
+}
+
+/*
+ * Time xorCipher() on buffers too short to expand the key for
+ * Keyed lengths run from a window of the key, the rest byte by byte.
+ */
+static void benchXorBuffer(const BenchConfig *config) {
+    static const int keyLengths[] = { 13, 16, 32, 64 };
+    double minSeconds = config->quick ? BENCH_QUICK_MIN_SECONDS : BENCH_MIN_SECONDS;
+    unsigned char buffer[1024];
+    char key[MAX_KEY_LENGTH];
+
+    fillRandom(buffer, sizeof(buffer), 23);
+    for (size_t i = 0; i < sizeof(keyLengths) / sizeof(keyLengths[0]); i++) {
+        BenchResult result;
+        uint64_t bytes = 0;
+        double start;
+        uint64_t startCycles;
+
+        fillRandom((unsigned char *)key, (size_t)keyLengths[i], (uint64_t)keyLengths[i]);
+        start = nowSeconds();
+        startCycles = readCycles();
+        do {
+            for (int n = 0; n < 1024; n++) {
+                xorCipher(buffer, sizeof(buffer), key, (size_t)keyLengths[i]);
+            }
+            bytes += 1024 * sizeof(buffer);
+        } while (nowSeconds() - start < minSeconds);
+
+        memset(&result, 0, sizeof(result));
+        result.bench = "xor_buffer";
+        result.kernel = xorKernelName();
+        result.keyLen = keyLengths[i];
+        result.bufferSize = sizeof(buffer);
+        result.threads = 1;
+        result.bytes = bytes;
+        result.cycles = readCycles() - startCycles;
+        result.seconds = nowSeconds() - start;
+        emitResult(&result);
+    }
+}
+
+/*
+ * Time every supported AEAD implementation sealing 64 KiB chunks
+ * Chunks are sealed in place as container records, as files are.
+ */
+static void benchAead(const BenchConfig *config) {
+    double minSeconds = config->quick ? BENCH_QUICK_MIN_SECONDS : BENCH_MIN_SECONDS;
+    size_t recordSize = CONTAINER_RECORD_SIZE(AEAD_CHUNK_SIZE);
+    size_t chunks = 16 * 1024 * 1024 / recordSize;
+    unsigned char *buffer = (unsigned char *)malloc(chunks * recordSize);
+    unsigned char rawKey[AEAD_KEY_SIZE];
+    unsigned char salt[AEAD_SALT_SIZE];
+    ContainerHeader header;
+    AeadKey key;
+
+    if (buffer == NULL) {
+        fprintf(stderr, "bench: out of memory\n");
+        return;
+    }
+    fillRandom(buffer, chunks * recordSize, 7);
+    fillRandom(rawKey, sizeof(rawKey), 11);
+    fillRandom(salt, sizeof(salt), 13);
+
+    for (size_t k = 0; k < aeadImplCount; k++) {
+        BenchResult result;
+        uint64_t index = 0;
+        double start;
+        uint64_t startCycles;
+
+        if (useAeadImpl(aeadImpls[k].name) != 0) {
+            continue;
+        }
+        aeadKeyInit(&key, aeadImpls[k].cipher, rawKey);
+        containerHeaderInit(&header, aeadImpls[k].cipher, COMPRESSION_NONE, 0, DEFAULT_KDF_COST,
+                            salt, salt);
+
+        start = nowSeconds();
+        startCycles = readCycles();
+        do {
+            for (size_t i = 0; i < chunks; i++, index++) {
+                containerSeal(&key, &header, index, AEAD_CHUNK_SIZE, AEAD_CHUNK_SIZE, 0,
+                              buffer + i * recordSize);
+            }
+        } while (nowSeconds() - start < minSeconds);
+
+        memset(&result, 0, sizeof(result));
+        result.bench = "aead";
+        result.kernel = aeadImpls[k].name;
+        result.bufferSize = AEAD_CHUNK_SIZE;
+        result.threads = 1;
+        result.bytes = index * AEAD_CHUNK_SIZE;
+        result.cycles = readCycles() - startCycles;
+        result.seconds = nowSeconds() - start;
+        emitResult(&result);
+    }
+
+    // Back to the automatic choice for the file benchmarks
+    useAeadImpl(NULL);
+    secureZero(&key, sizeof(key));
+    free(buffer);
+}
+
+/*
+ * Time every supported BLAKE3 chunk hasher on 64 KiB leaves
+ * Leaves are hashed one by one into a tree, as --digest hashes files.
+ */
+static void benchHash(const BenchConfig *config) {
+    double minSeconds = config->quick ? BENCH_QUICK_MIN_SECONDS : BENCH_MIN_SECONDS;
+    size_t size = 16 * 1024 * 1024;
+    unsigned char *buffer = (unsigned char *)malloc(size);
+
+    if (buffer == NULL) {
+        fprintf(stderr, "bench: out of memory\n");
+        return;
+    }
+    fillRandom(buffer, size, 19);
+
+    for (size_t k = 0; k < blake3ImplCount; k++) {
+        BenchResult result;
+        uint64_t leaves = 0;
+        Blake3Tree tree;
+        double start;
+        uint64_t startCycles;
+
+        if (useBlake3Impl(blake3Impls[k].name) != 0) {
+            continue;
+        }
+        blake3TreeInit(&tree);
+
+        start = nowSeconds();
+        startCycles = readCycles();
+        do {
+            for (size_t offset = 0; offset < size; offset += BLAKE3_LEAF_SIZE, leaves++) {
+                Blake3Output out;
+                uint32_t cv[8];
+                blake3Subtree(buffer + offset, BLAKE3_LEAF_SIZE,
+                              leaves * (BLAKE3_LEAF_SIZE / BLAKE3_CHUNK_SIZE), &out);
+                blake3OutputCv(&out, cv);
+                blake3TreePush(&tree, cv);
+            }
+        } while (nowSeconds() - start < minSeconds);
+
+        memset(&result, 0, sizeof(result));
+        result.bench = "hash";
+        result.kernel = blake3Impls[k].name;
+        result.bufferSize = BLAKE3_LEAF_SIZE;
+        result.threads = 1;
+        result.bytes = leaves * BLAKE3_LEAF_SIZE;
+        result.cycles = readCycles() - startCycles;
+        result.seconds = nowSeconds() - start;
+        emitResult(&result);
+    }
+
+    // Back to the automatic choice for the file benchmarks
+    useBlake3Impl(NULL);
+    free(buffer);
+}
+
+/*
+ * Time one scrypt derivation at the default cost (the minimum with --quick)
+ * This is what a job pays once before its first authenticated file; bytes
+ * is the working memory it fills.
+ */
+static void benchKdf(const BenchConfig *config) {
+    int cost = config->quick ? MIN_KDF_COST : DEFAULT_KDF_COST;
+    const char *passphrase = "benchmark-key-0123456789";
+    unsigned char salt[AEAD_SALT_SIZE];
+    unsigned char master[AEAD_KEY_SIZE];
+    BenchResult result;
+    double start;
+    uint64_t startCycles;
+
+    fillRandom(salt, sizeof(salt), 17);
+    start = nowSeconds();
+    startCycles = readCycles();
+    if (scryptDerive((const unsigned char *)passphrase, strlen(passphrase), salt, sizeof(salt),
+                     cost, SCRYPT_BLOCK_FACTOR, SCRYPT_PARALLELISM, master, sizeof(master)) != 0) {
+        fprintf(stderr, "bench: out of memory\n");
+        return;
+    }
+
+    memset(&result, 0, sizeof(result));
+    result.cycles = readCycles() - startCycles;
+    result.seconds = nowSeconds() - start;
+    result.bench = "kdf";
+    result.kernel = "scrypt";
+    result.bytes = (uint64_t)128 * SCRYPT_BLOCK_FACTOR << cost;
+    result.threads = 1;
+    emitResult(&result);
+    secureZero(master, sizeof(master));
+}
+
+/*
+ * Write a benchmark input file
+ * Returns: 0 on success, -1 on failure
+ */
+static int createInputFile(const char *path, uint64_t size) {
+    FILE *file = fopen(path, "wb");
+    unsigned char *chunk;
+    uint64_t written = 0;
+
+    if (file == NULL) {
+        return -1;
+    }
+    chunk = (unsigned char *)malloc(1024 * 1024);
+    if (chunk == NULL) {
+        fclose(file);
+        return -1;
+    }
+    fillRandom(chunk, 1024 * 1024, 7);
+    while (written < size) {
+        size_t n = size - written < 1024 * 1024 ? (size_t)(size - written) : 1024 * 1024;
+        if (fwrite(chunk, 1, n, file) != n) {
+            break;
+        }
+        written += n;
+    }
+    free(chunk);
+    return fclose(file) == 0 && written == size ? 0 : -1;
+}
+
+/*
+ * Time transformFile() for one backend configuration
+ */
+static void benchFileBackend(const char *location, const char *backend, const char *inputPath,
+                             const char *outputPath, KeyContext *keys,
+                             const ProcessOptions *options, uint64_t size) {
+    BenchResult result;
+    double start;
+    uint64_t startCycles;
+    int status;
+
+    start = nowSeconds();
+    startCycles = readCycles();
+    status = transformFile(inputPath, outputPath, keys, options);
+
+    memset(&result, 0, sizeof(result));
+    result.cycles = readCycles() - startCycles;
+    result.seconds = nowSeconds() - start;
+    remove(outputPath);
+    if (status != 0) {
+        fprintf(stderr, "bench: %s backend failed on %s\n", backend, location);
+        return;
+    }
+
+    result.bench = "file";
+    result.kernel = options->gpuBackend != NULL ? gpuName(options->gpuBackend) : xorKernelName();
+    result.backend = backend;
+    result.location = location;
+    result.threads = options->threads;
+    result.bytes = size;
+    emitResult(&result);
+}
+
+/*
+ * End-to-end file benchmarks in one directory
+ */
+static void benchFiles(const BenchConfig *config, const char *location, const char *dir) {
+    char inputPath[MAX_PATH_LENGTH];
+    char outputPath[MAX_PATH_LENGTH];
+    uint64_t size = (uint64_t)config->fileMegabytes * 1024 * 1024;
+    const char *key = "benchmark-key-0123456789";
+    KeyContext *keys = keyContextCreate(key);
+    ProcessOptions options;
+
+    if (keys == NULL) {
+        return;
+    }
+    if (joinPath(inputPath, sizeof(inputPath), dir, "fe_bench_input.bin") != 0
+        || joinPath(outputPath, sizeof(outputPath), dir, "fe_bench_output.bin") != 0
+        || createInputFile(inputPath, size) != 0) {
+        fprintf(stderr, "bench: cannot create input file in '%s', skipping\n", dir);
+        remove(inputPath);
+        keyContextDestroy(keys);
+        return;
+    }
+
+    initProcessOptions(&options);
+    options.showProgress = 0;
+
+    options.threads = 1;
+    benchFileBackend(location, "sequential", inputPath, outputPath, keys, &options, size);
+
+    options.threads = config->threads;
+    options.pool = poolCreate(config->threads, PARALLEL_SEGMENT_SIZE, NULL, NULL);
+    if (options.pool != NULL) {
+        benchFileBackend(location, "parallel", inputPath, outputPath, keys, &options, size);
+    }
+
+    options.useMmap = 1;
+    options.threads = 1;
+    benchFileBackend(location, "mmap", inputPath, outputPath, keys, &options, size);
+    if (options.pool != NULL) {
+        options.threads = config->threads;
+        benchFileBackend(location, "mmap", inputPath, outputPath, keys, &options, size);
+    }
+    options.useMmap = 0;
+
+    options.asyncIo = 1;
+    options.threads = 1;
+    benchFileBackend(location, "async", inputPath, outputPath, keys, &options, size);
+    options.asyncIo = 0;
+
+    // Every file goes to the GPU when the bench offloads at all
+    options.gpuBackend = gpuCreate();
+    if (options.gpuBackend != NULL) {
+        options.gpuThreshold = 0;
+        options.threads = 1;
+        benchFileBackend(location, "gpu", inputPath, outputPath, keys, &options, size);
+        gpuDestroy(options.gpuBackend);
+        options.gpuBackend = NULL;
+    } else {
+        fprintf(stderr, "bench: no OpenCL GPU, skipping the gpu backend on %s\n", location);
+    }
+
+    if (options.pool != NULL) {
+        poolDestroy(options.pool);
+    }
+    remove(inputPath);
+    keyContextDestroy(keys);
+}
+
+static void printBenchUsage(const char *program) {
+    fprintf(stderr, "Usage: %s [options]\n", program);
+    fprintf(stderr, "  --output FILE     Write JSON to FILE instead of stdout\n");
+    fprintf(stderr, "  --tmpfs DIR       Memory-backed directory (default: /dev/shm)\n");
+    fprintf(stderr, "  --disk DIR        Disk-backed directory (default: .)\n");
+    fprintf(stderr, "  --file-size MB    Size of the file benchmarks (default: %d)\n",
+            BENCH_DEFAULT_FILE_MB);
+    fprintf(stderr, "  --threads N       Threads for the multi-threaded runs (default: all CPUs)\n");
+    fprintf(stderr, "  --quick           Short run for smoke testing\n");
+    fprintf(stderr, "  --kernels-only    Skip the file benchmarks\n");
+}
+
+int main(int argc, char *argv[]) {
+    BenchConfig config;
+
+    memset(&config, 0, sizeof(config));
+#ifdef _WIN32
+    config.tmpfsDir = NULL;
+#else
+    config.tmpfsDir = "/dev/shm";
+#endif
+    config.diskDir = ".";
+    config.fileMegabytes = 0;
+    config.threads = getHardwareConcurrency();
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        int hasValue = i + 1 < argc;
+
+        if (strcmp(arg, "--output") == 0 && hasValue) {
+            config.outputPath = argv[++i];
+        } else if (strcmp(arg, "--tmpfs") == 0 && hasValue) {
+            config.tmpfsDir = argv[++i];
+        } else if (strcmp(arg, "--disk") == 0 && hasValue) {
+            config.diskDir = argv[++i];
+        } else if (strcmp(arg, "--file-size") == 0 && hasValue) {
+            if (parseIntOption("File size", argv[++i], 1, 1024 * 1024, &config.fileMegabytes) != 0) {
+                return 1;
+            }
+        } else if (strcmp(arg, "--threads") == 0 && hasValue) {
+            if (parseIntOption("Thread count", argv[++i], 1, MAX_THREADS, &config.threads) != 0) {
+                return 1;
+            }
+        } else if (strcmp(arg, "--quick") == 0) {
+            config.quick = 1;
+        } else if (strcmp(arg, "--kernels-only") == 0) {
+            config.skipFiles = 1;
+        } else {
+            printBenchUsage(argv[0]);
+            return strcmp(arg, "--help") == 0 ? 0 : 1;
+        }
+    }
+    if (config.fileMegabytes == 0) {
+        config.fileMegabytes = config.quick ? BENCH_QUICK_FILE_MB : BENCH_DEFAULT_FILE_MB;
+    }
+
+    jsonOut = stdout;
+    if (config.outputPath != NULL) {
+        jsonOut = fopen(config.outputPath, "w");
+        if (jsonOut == NULL) {
+            fprintf(stderr, "bench: cannot write '%s': %s\n", config.outputPath, strerror(errno));
+            return 1;
+        }
+    }
+
+    fprintf(jsonOut, "{\n  \"schema\": 1,\n  \"default_kernel\": \"%s\",\n", xorKernelName());
+    fprintf(jsonOut, "  \"hardware_threads\": %d,\n  \"results\": [", getHardwareConcurrency());
+
+    benchKernels(&config);
+    benchXorBuffer(&config);
+    benchAead(&config);
+    benchHash(&config);
+    benchKdf(&config);
+    if (!config.skipFiles) {
+        if (config.tmpfsDir != NULL) {
+            benchFiles(&config, "tmpfs", config.tmpfsDir);
+        }
+        benchFiles(&config, "disk", config.diskDir);
+    }
+
+    fprintf(jsonOut, "\n  ]\n}\n");
+    if (jsonOut != stdout) {
+        fclose(jsonOut);
+    }
+    return 0;
+}
@@ -0,0 +1,125 @@
+/*
+ * File Encryption and Decryption System - library interface
+ * Programs that link the engine (libfileencrypt) call these functions to
+ * encrypt in-process, instead of running the file_encrypt executable.
+ * Nothing is printed: failures come back as an FeStatus, with the message
+ * in feLastError() and, optionally, a message callback.
+ */
+
+#ifndef FILE_ENCRYPT_H
+#define FILE_ENCRYPT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+// Same layout as the POSIX scatter/gather element
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Result of a library call
+ *   FE_ERROR_ARGUMENT: Bad configuration, key, path or range
+ *   FE_ERROR_IO: A file or stream callback could not be read or written
+ *   FE_ERROR_MEMORY: Out of memory, or over the configured cap
+ *   FE_ERROR_AUTH: Wrong key, or damaged, truncated or reordered data
+ *   FE_ERROR_FORMAT: Not a container, or one of another cipher or version
+ *   FE_ERROR_EXISTS: The output exists and overwrite is not set
+ *   FE_ERROR_SYSTEM: Threads or random bytes were not available
+ */
+typedef enum {
+    FE_OK = 0,
+    FE_ERROR_ARGUMENT = -1,
+    FE_ERROR_IO = -2,
+    FE_ERROR_MEMORY = -3,
+    FE_ERROR_AUTH = -4,
+    FE_ERROR_FORMAT = -5,
+    FE_ERROR_EXISTS = -6,
+    FE_ERROR_SYSTEM = -7
+} FeStatus;
+
+/*
+ * Engine state for one passphrase: expanded key, derived keys, worker
+ * threads and buffers, reused by every call made with it. A context may
+ * be used by one thread at a time; create one per thread to run calls
+ * side by side.
+ */
+typedef struct FeContext FeContext;
+
+/*
+ * Stream callbacks (see feEncryptStream)
+ * FeReadFn reads up to size bytes into buffer and returns the number read,
+ * 0 at the end of the stream or -1 on failure. FeWriteFn writes all size
+ * bytes and returns 0, or -1 on failure. Either may set errno.
+ */
+typedef long (*FeReadFn)(void *userData, unsigned char *buffer, size_t size);
+typedef int (*FeWriteFn)(void *userData, const unsigned char *data, size_t size);
+
+/*
+ * Progress and message callbacks (see FeConfig)
+ * progress gets the bytes processed and the total of the current file.
+ * message gets each error or warning, without a trailing newline; status
+ * is FE_OK for a warning that does not fail the call.
+ */
+typedef void (*FeProgressFn)(void *userData, uint64_t current, uint64_t total);
+typedef void (*FeMessageFn)(void *userData, FeStatus status, const char *message);
+
+/*
+ * Context configuration (set defaults with feConfigInit)
+ *   cipher: "xor" (default), "chacha20-poly1305" or "aes-256-gcm"
+ *   continuous: Use the phase-continuous v2 XOR stream mode instead of the
+ *               legacy v1 mode; XOR output does not record which was used
+ *   compress: "lz4" or "none" (default); needs an authenticated cipher
+ *   kdfCost: log2 of the scrypt cost for new authenticated files (10-20)
+ *   threads: Worker threads (1 = sequential; default one per CPU)
+ *   maxMemory: Cap on the bytes of I/O buffers held at once (0 for none)
+ *   incremental: Update earlier outputs in place (authenticated ciphers)
+ *   digest: Store a BLAKE3 digest of the plaintext in new containers (not
+ *           incremental ones); decryption checks any digest it finds
+ *   overwrite: Replace outputs that already exist
+ *   progress, message: Callbacks, or NULL
+ *   userData: Passed to progress and message
+ */
+typedef struct {
+    const char *cipher;
+    int continuous;
+    const char *compress;
+    int kdfCost;
+    int threads;
+    size_t maxMemory;
+    int incremental;
+    int digest;
+    int overwrite;
+    FeProgressFn progress;
+    FeMessageFn message;
+    void *userData;
+} FeConfig;
+
+void feConfigInit(FeConfig *config);
+FeStatus feContextCreate(const FeConfig *config, const char *key, FeContext **out);
+void feContextDestroy(FeContext *ctx);
+FeStatus feEncryptFile(FeContext *ctx, const char *inputFile, const char *outputFile);
+FeStatus feDecryptFile(FeContext *ctx, const char *inputFile, const char *outputFile);
+FeStatus feEncryptStream(FeContext *ctx, FeReadFn readFn, FeWriteFn writeFn, void *userData);
+FeStatus feDecryptStream(FeContext *ctx, FeReadFn readFn, FeWriteFn writeFn, void *userData);
+FeStatus feDecryptRange(FeContext *ctx, const char *inputFile, uint64_t offset, size_t length,
+                        unsigned char *out, size_t *outLen);
+FeStatus feEncryptBuffer(FeContext *ctx, unsigned char *data, size_t size, uint64_t streamOffset);
+FeStatus feEncryptIov(FeContext *ctx, const struct iovec *iov, int count, uint64_t streamOffset);
+const char *feLastError(const FeContext *ctx);
+const char *feStatusString(FeStatus status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
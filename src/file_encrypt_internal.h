@@ -0,0 +1,934 @@
+/*
+ * File Encryption and Decryption System - engine internals
+ * Constants, types and the engine functions shared by the command-line
+ * front end (main.c), the benchmark and the tests. Programs that use the
+ * library include file_encrypt.h instead.
+ */
+
+#ifndef FILE_ENCRYPT_INTERNAL_H
+#define FILE_ENCRYPT_INTERNAL_H
+
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+// 64-bit off_t for fstat/pread/mmap on 32-bit platforms
+#if !defined(_WIN32) && !defined(_FILE_OFFSET_BITS)
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <bcrypt.h>
+#include <io.h>
+#include <direct.h>
+#include <process.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "bcrypt")
+#endif
+#else
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <dlfcn.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define FE_HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define FE_ARCH_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64) || defined(__ARM_NEON)
+#define FE_ARCH_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define FE_TARGET(isa) __attribute__((target(isa)))
+#else
+#define FE_TARGET(isa)
+#endif
+
+// Engine functions shared with the front end, the benchmark and the tests
+// are hidden, and the build makes them local to the public library, so
+// libfileencrypt exports the fe* API only
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(_WIN32)
+#define FE_INTERNAL __attribute__((visibility("hidden")))
+#else
+#define FE_INTERNAL
+#endif
+
+#ifdef _MSC_VER
+#define FE_THREAD_LOCAL __declspec(thread)
+#else
+#define FE_THREAD_LOCAL _Thread_local
+#endif
+
+#include "file_encrypt.h"
+
+// Constants
+#define MAX_FILENAME_LENGTH 256
+#define MAX_KEY_LENGTH 128
+#define BUFFER_SIZE 4096
+#define MAX_BUFFER_SIZE (1024 * 1024)
+#define MIN_KEY_LENGTH 4
+#define MAX_PATH_LENGTH 4096
+
+#ifdef _WIN32
+#define PATH_SEPARATOR '\\'
+#define PATH_SEPARATOR_STRING "\\"
+#else
+#define PATH_SEPARATOR '/'
+#define PATH_SEPARATOR_STRING "/"
+#endif
+
+// Key stream geometry: the repeating key is expanded into a block whose
+// length is a multiple of both the key length and the widest vector unroll
+#define KEYSTREAM_ALIGN 64
+#define KEYSTREAM_MIN_PERIOD 4096
+#define KEYSTREAM_MAX_PERIOD (64 * MAX_KEY_LENGTH)
+#define XOR_KEYED_COUNT 3
+
+// Version 1 files restart the key at every 4096-byte chunk; this is fixed
+// by the format and must not follow BUFFER_SIZE
+#define LEGACY_CHUNK_SIZE 4096
+
+/*
+ * Cipher stream modes
+ * LEGACY_V1 reproduces output of releases that restarted the key phase at
+ * every read chunk. CONTINUOUS_V2 keys byte n of the file with key[n % keyLen],
+ * so the ciphertext no longer depends on how the file is split up. XOR files
+ * have no header to say which mode wrote them, so the default stays the one
+ * every earlier release wrote and v2 is chosen explicitly (--continuous).
+ */
+typedef enum {
+    CIPHER_MODE_LEGACY_V1 = 1,
+    CIPHER_MODE_CONTINUOUS_V2 = 2
+} CipherMode;
+
+#define DEFAULT_CIPHER_MODE CIPHER_MODE_LEGACY_V1
+
+// Ciphers: XOR is the legacy keyed stream, the others are AEADs
+typedef enum {
+    CIPHER_XOR = 0,
+    CIPHER_CHACHA20_POLY1305 = 1,
+    CIPHER_AES_256_GCM = 2
+} CipherId;
+
+#define DEFAULT_CIPHER CIPHER_XOR
+
+// Authenticated cipher parameters
+#define AEAD_KEY_SIZE 32
+#define AEAD_NONCE_SIZE 12
+#define AEAD_TAG_SIZE 16
+#define AEAD_SALT_SIZE 16
+#define AEAD_CHUNK_SIZE (64 * 1024)
+#define GCM_HASH_POWERS 8
+
+// BLAKE3: 1 KiB chunks hashed into a binary tree. Leaves of
+// BLAKE3_LEAF_SIZE bytes (a power of two chunks) are hashed in one call;
+// a container chunk is one leaf. The stack of a tree covers 2^54 leaves.
+#define BLAKE3_CHUNK_SIZE 1024
+#define BLAKE3_LEAF_SIZE (64 * 1024)
+#define BLAKE3_MAX_DEPTH 54
+#define BLAKE3_DIGEST_SIZE 32
+
+// Container of authenticated files: header, sealed records (data chunks,
+// then the chunk index) and a footer pointing at the index record
+#define CONTAINER_MAGIC "\x89" "FEC\r\n\x1a\n"
+#define CONTAINER_MAGIC_SIZE 8
+#define CONTAINER_FOOTER_MAGIC "FECINDEX"
+#define CONTAINER_VERSION 2
+#define CONTAINER_HEADER_SIZE 64
+#define CONTAINER_RECORD_HEADER_SIZE 16
+#define CONTAINER_INDEX_ENTRY_SIZE 32
+#define CONTAINER_FOOTER_SIZE 16
+#define CONTAINER_MIN_CHUNK_SIZE 4096
+#define CONTAINER_MAX_CHUNK_SIZE (1024 * 1024)
+#define CONTAINER_RECORD_SIZE(chunkSize) \
+    ((chunkSize) + CONTAINER_RECORD_HEADER_SIZE + AEAD_TAG_SIZE)
+
+// Record flags: a record is a data chunk unless it is the index; the
+// last data chunk is flagged so a reader of one range can tell whether
+// the file was cut short. A hole record stands for whole chunks of zeros
+// and stores nothing.
+#define RECORD_FLAG_INDEX 0x1
+#define RECORD_FLAG_FINAL 0x2
+#define RECORD_FLAG_COMPRESSED 0x4
+#define RECORD_FLAG_HOLE 0x8
+
+// Container flags (header byte 56): HOLES marks a container made from a
+// sparse file, whose index may hold hole records; CHUNKED marks an
+// incremental container, whose records hold content-defined chunks of up
+// to chunkSize bytes and may be shared by several entries or left unused
+// by an update; DIGEST marks one whose index record ends with a BLAKE3
+// digest of the whole plaintext
+#define CONTAINER_FLAG_HOLES 0x1
+#define CONTAINER_FLAG_CHUNKED 0x2
+#define CONTAINER_FLAG_DIGEST 0x4
+#define CONTAINER_DIGEST_SIZE BLAKE3_DIGEST_SIZE
+
+// Content-defined chunking of incremental containers (FastCDC): a chunk
+// ends where a rolling hash over the last CDC_WINDOW bytes matches a mask,
+// harder to match before the average size than after it, so an insert or
+// delete only changes the chunks around it. Index entries of these
+// containers add the high half of the record number and a keyed hash of
+// the chunk, and the index record is preceded by its own record number.
+#define CDC_MIN_CHUNK (16 * 1024)
+#define CDC_AVG_BITS 16
+#define CDC_MAX_CHUNK (256 * 1024)
+#define CDC_WINDOW 64
+#define CDC_MASK(bits) (~UINT64_C(0) << (64 - (bits)))
+#define CDC_MASK_SMALL CDC_MASK(CDC_AVG_BITS + 2)
+#define CDC_MASK_LARGE CDC_MASK(CDC_AVG_BITS - 2)
+#define CDC_HASH_SIZE 12
+#define CONTAINER_CHUNKED_ENTRY_SIZE 48
+#define CONTAINER_INDEX_ID_SIZE 8
+// Incremental segments are cut at content-defined points near multiples
+// of CDC_SEGMENT_SIZE, so a segment holds at most one chunk more and its
+// input and records each fit half of the scratch buffer
+#define CDC_SEGMENT_SIZE (PARALLEL_SEGMENT_SIZE / 2 - 2 * CDC_MAX_CHUNK)
+#define CDC_SEGMENT_CHUNKS ((CDC_SEGMENT_SIZE + CDC_MAX_CHUNK) / CDC_MIN_CHUNK + 1)
+
+// Compression codecs recorded in the container header. A compressed
+// container stores each chunk compressed unless that does not make it
+// smaller, so its records vary in size and are found through the index.
+#define COMPRESSION_NONE 0
+#define COMPRESSION_LZ4 1
+
+// LZ4 block format: matches of at least 4 bytes up to 64 KiB back; the
+// last 5 bytes are literals and no match starts in the last 12
+#define LZ4_HASH_LOG 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_LIMIT 12
+#define LZ4_MAX_OFFSET 65535
+
+// Key derivation functions recorded in the container header. scrypt
+// turns the passphrase into a master key once per job (cost N = 2^cost,
+// r = 8, p = 1); each file's key is expanded from it with its own salt.
+#define KDF_SCRYPT 2
+#define SCRYPT_BLOCK_FACTOR 8
+#define SCRYPT_PARALLELISM 1
+#define DEFAULT_KDF_COST 15
+#define MIN_KDF_COST 10
+#define MAX_KDF_COST 20
+
+// Master keys remembered per key context, so files of one job (or
+// decryptions of files from the same job) run the KDF only once
+#define KDF_CACHE_SIZE 8
+
+// Parallel engine: files larger than one segment are split into segments
+// that workers read, encrypt and write back independently
+#define PARALLEL_SEGMENT_SIZE (4 * 1024 * 1024)
+#define POOL_QUEUE_CAPACITY 256
+#define MAX_THREADS 256
+
+// Buffer pool: I/O buffers are page aligned, and with --huge-pages those
+// of at least one huge page are aligned to it and offered to the kernel
+// for transparent huge pages. Released buffers are kept for reuse, up to
+// BUFFER_POOL_CACHE of them; --max-memory caps the bytes held.
+#define BUFFER_PAGE_SIZE 4096
+#define BUFFER_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define BUFFER_POOL_CACHE 32
+#define MIN_MEMORY_LIMIT (16 * 1024 * 1024)
+
+// Worker placement (--cpus, --numa): CPUs and NUMA nodes that can be named
+#define MAX_CPUS 1024
+#define CPU_MASK_WORDS (MAX_CPUS / 64)
+#define MAX_NUMA_NODES 64
+
+// Memory-mapped backend: bytes mapped per segment (a multiple of every
+// platform's mapping granularity)
+#define MMAP_SEGMENT_SIZE (64 * 1024 * 1024)
+
+// Asynchronous pipeline: buffer size and in-flight reads (and writes)
+#define ASYNC_BUFFER_SIZE (1024 * 1024)
+#define DEFAULT_QUEUE_DEPTH 4
+#define MAX_QUEUE_DEPTH 64
+
+// GPU offload (--gpu): files of at least the threshold go through
+// GPU_SLOTS staging slots of GPU_CHUNK_SIZE bytes on the first OpenCL GPU
+#define GPU_CHUNK_SIZE (32 * 1024 * 1024)
+#define GPU_SLOTS 3
+#define GPU_MAX_PLATFORMS 8
+#define DEFAULT_GPU_THRESHOLD ((size_t)256 * 1024 * 1024)
+#define MIN_GPU_THRESHOLD (1024 * 1024)
+
+// openRaw() modes; RAW_OPEN_DIRECT may be added to bypass the page cache
+#define RAW_OPEN_READ 0
+#define RAW_OPEN_CREATE 1
+#define RAW_OPEN_UPDATE 2
+#define RAW_OPEN_NEW 3
+#define RAW_OPEN_DIRECT 4
+
+// Directory descriptor for names relative to the working directory
+#ifdef _WIN32
+#define FE_CWD -1
+#else
+#define FE_CWD AT_FDCWD
+#endif
+
+// Inputs the batch pre-flight keeps open for files waiting in the queues
+// (at most a quarter of the descriptor limit); past it the worker opens
+// the file again
+#define BATCH_OPEN_INPUTS 256
+
+// Cache behaviour of a segmented job's descriptors (--drop-cache, --direct-io).
+// Direct I/O transfers whole DIRECT_IO_ALIGNMENT blocks between aligned
+// buffers, padding the tail of the file.
+#define IO_BUFFERED 0
+#define IO_DROP_CACHE 1
+#define IO_DIRECT 2
+#define DIRECT_IO_ALIGNMENT 4096
+
+// Streaming (pipe) mode: path naming standard input/output, read size
+#define STDIO_PATH "-"
+#define STREAM_BUFFER_SIZE (1024 * 1024)
+
+// Portable threading primitives
+#ifdef _WIN32
+typedef HANDLE ThreadHandle;
+typedef CRITICAL_SECTION MutexHandle;
+typedef CONDITION_VARIABLE CondHandle;
+#else
+typedef pthread_t ThreadHandle;
+typedef pthread_mutex_t MutexHandle;
+typedef pthread_cond_t CondHandle;
+#endif
+
+/*
+ * Worker pool task
+ * Each task processes one byte range; scratch is the worker's private
+ * buffer of the pool's scratchSize bytes.
+ */
+typedef void (*PoolTaskFn)(void *arg, uint64_t offset, size_t length, unsigned char *scratch);
+
+typedef struct {
+    PoolTaskFn fn;
+    void *arg;
+    uint64_t offset;
+    size_t length;
+} PoolTask;
+
+/*
+ * Page-aligned I/O buffers shared by the threads of a run
+ * Buffers are handed out by ownership: whoever acquires one releases it,
+ * possibly from another thread. Released buffers are cached with the NUMA
+ * node of the releasing thread and handed out again for the same size,
+ * preferably on the same node. held counts cached and outstanding bytes;
+ * an acquire that would take it past limit (0 for none) first frees
+ * cached buffers, then waits for outstanding ones to come back.
+ */
+typedef struct {
+    size_t limit;
+    int hugePages;
+    size_t held;
+    size_t outstanding;
+    unsigned char *cached[BUFFER_POOL_CACHE];
+    size_t cachedSize[BUFFER_POOL_CACHE];
+    int cachedNode[BUFFER_POOL_CACHE];
+    int cachedCount;
+    MutexHandle lock;
+    CondHandle released;
+} BufferPool;
+
+/*
+ * Where the workers of a pool run
+ * Worker i is pinned to the CPUs in mask[i % slotCount]; node is the NUMA
+ * node of those CPUs (-1 if unknown).
+ */
+typedef struct {
+    int slotCount;
+    uint64_t mask[MAX_THREADS][CPU_MASK_WORDS];
+    int node[MAX_THREADS];
+} CpuPlacement;
+
+/*
+ * Tasks queued on one worker of a pool; the worker and the thieves
+ * both take from the head
+ */
+typedef struct {
+    PoolTask tasks[POOL_QUEUE_CAPACITY];
+    size_t head;
+    size_t count;
+    MutexHandle lock;
+} PoolLocalQueue;
+
+/*
+ * Fixed-size pool of worker threads
+ * Segment tasks (poolSubmit) go to the shared queue, which keeps them in
+ * submission order, and take a scratch buffer from buffers. Independent
+ * tasks (poolSubmitLocal) are spread over the workers' own queues, and a
+ * worker whose queue is empty steals from the others, so many short tasks
+ * do not all pass through one lock. Workers look at the shared queue
+ * first. localCount is the number of local queues, one per worker asked
+ * for. pending counts tasks submitted and not finished; localQueued, the
+ * tasks in local queues or reserved there; sharedQueued mirrors
+ * queueCount for lock-free peeks; sleepers and blockedSubmitters, the
+ * threads waiting on notEmpty and notFull. Those five are updated with
+ * atomics, the shared queue under lock.
+ */
+typedef struct {
+    ThreadHandle *threads;
+    int threadCount;
+    size_t scratchSize;
+    BufferPool *buffers;
+    int ownsBuffers;
+    const CpuPlacement *placement;
+    int startedWorkers;
+    PoolTask queue[POOL_QUEUE_CAPACITY];
+    size_t queueHead;
+    size_t queueCount;
+    PoolLocalQueue *local;
+    int localCount;
+    int64_t nextLocal;
+    int64_t pending;
+    int64_t localQueued;
+    int64_t sharedQueued;
+    int64_t sleepers;
+    int64_t blockedSubmitters;
+    int stopping;
+    MutexHandle lock;
+    CondHandle notEmpty;
+    CondHandle notFull;
+    CondHandle idle;
+} WorkerPool;
+
+/*
+ * A mapped view of part of a file
+ */
+typedef struct {
+    void *base;
+    unsigned char *data;
+    size_t mapLength;
+#ifdef _WIN32
+    HANDLE mapping;
+#endif
+} MappedRegion;
+
+typedef struct GpuBackend GpuBackend;
+
+/*
+ * Options that control how a file is processed
+ *   mode: Cipher stream mode
+ *   threads: Worker threads for large files (1 = sequential)
+ *   pool: Shared worker pool, or NULL to start one for each file
+ *   buffers: Shared buffer pool, or NULL to allocate buffers directly
+ *   maxMemory: Cap on the bytes of I/O buffers held at once (0 for none)
+ *   hugePages: Back large buffers with transparent huge pages
+ *   cpuList: CPUs for the workers (--cpus), or NULL for any
+ *   numa: Spread the workers over NUMA nodes, one node per worker
+ *   placement: Pinning worked out from cpuList and numa, or NULL for none
+ *   useMmap: Process through memory mappings instead of read/write
+ *   inPlace: Allow output == input, transforming the file in place (mmap)
+ *   asyncIo: Overlap reads, cipher and writes (io_uring where available)
+ *   directIo: Bypass the page cache for files (buffered with dropCache
+ *             where the file system refuses)
+ *   dropCache: Evict file data from the page cache once processed
+ *   queueDepth: Reads and writes kept in flight by the async pipeline
+ *   gpu: Offload the xor cipher of large files to an OpenCL GPU (--gpu)
+ *   gpuThreshold: Smallest file offloaded
+ *   gpuBackend: The GPU set up for the run, or NULL to use the CPU
+ *   showProgress: Progress format (PROGRESS_NONE, _AUTO, _BAR or _MACHINE)
+ *   cipher: CIPHER_XOR, or the authenticated cipher to use
+ *   decrypt: 1 to decrypt (authenticated ciphers are not symmetric)
+ *   kdfCost: log2 of the scrypt cost N for new authenticated files
+ *   compression: Codec for new authenticated files (COMPRESSION_*)
+ *   incremental: Encrypt into incremental containers, updating the output
+ *                of an earlier run in place
+ *   syncOutput: Flush each output (fdatasync) before it is renamed into
+ *               place
+ *   digest: Record a BLAKE3 digest of the plaintext in new containers
+ *   printDigest: Print the digest of each container encrypted or
+ *                decrypted, in the format of b3sum
+ *   progressFn: Receives progress instead of the display (library calls)
+ *   progressData: Passed to progressFn
+ */
+typedef struct {
+    CipherMode mode;
+    int threads;
+    WorkerPool *pool;
+    BufferPool *buffers;
+    size_t maxMemory;
+    int hugePages;
+    const char *cpuList;
+    int numa;
+    CpuPlacement *placement;
+    int useMmap;
+    int inPlace;
+    int asyncIo;
+    int directIo;
+    int dropCache;
+    int queueDepth;
+    int gpu;
+    size_t gpuThreshold;
+    GpuBackend *gpuBackend;
+    int showProgress;
+    CipherId cipher;
+    int decrypt;
+    int kdfCost;
+    int compression;
+    int incremental;
+    int syncOutput;
+    int digest;
+    int printDigest;
+    FeProgressFn progressFn;
+    void *progressData;
+} ProcessOptions;
+
+// Progress formats; AUTO draws the bar only when stdout is a terminal
+#define PROGRESS_NONE 0
+#define PROGRESS_AUTO 1
+#define PROGRESS_BAR 2
+#define PROGRESS_MACHINE 3
+
+// Seconds between progress updates (bar, machine-readable lines)
+#define PROGRESS_BAR_INTERVAL 0.1
+#define PROGRESS_MACHINE_INTERVAL 1.0
+
+// Stages timed by --stats, in report order; IO_WAIT is time spent
+// waiting for io_uring completions
+#define STAT_READ 0
+#define STAT_CIPHER 1
+#define STAT_COMPRESS 2
+#define STAT_HASH 3
+#define STAT_WRITE 4
+#define STAT_SYNC 5
+#define STAT_IO_WAIT 6
+#define STAT_STAGES 7
+
+// Queues whose depth --stats samples: tasks waiting for a pool worker,
+// and blocks in flight in an async pipeline
+#define STAT_QUEUE_POOL 0
+#define STAT_QUEUE_ASYNC 1
+#define STAT_QUEUES 2
+
+// Threads counted separately by --stats (workers, I/O threads, the
+// main thread); any beyond are left out
+#define STATS_MAX_THREADS (MAX_THREADS + 8)
+
+// --stats report formats
+#define STATS_NONE 0
+#define STATS_TEXT 1
+#define STATS_JSON 2
+#define STATS_PROMETHEUS 3
+
+/*
+ * Counters of one thread for --stats
+ *   calls, bytes, ticks: Per stage (STAT_*); ticks of statsTicks()
+ *   queueSamples, queueTotal, queueMax: Depths seen, per queue (STAT_QUEUE_*)
+ */
+typedef struct {
+    uint64_t calls[STAT_STAGES];
+    uint64_t bytes[STAT_STAGES];
+    uint64_t ticks[STAT_STAGES];
+    uint64_t queueSamples[STAT_QUEUES];
+    uint64_t queueTotal[STAT_QUEUES];
+    uint64_t queueMax[STAT_QUEUES];
+} StatCounters;
+
+/*
+ * Expanded key stream
+ * bytes[] holds two copies of one period so that a run of up to `period`
+ * bytes can start at any phase without wrapping. `bytes` points into
+ * `storage`, so a KeyStream must not be copied; initialise it in place.
+ * keyedSlot is the keyed kernel of the key length (see xorKeyedLengths),
+ * or -1 if it has none.
+ */
+typedef struct {
+    unsigned char storage[2 * KEYSTREAM_MAX_PERIOD + KEYSTREAM_ALIGN];
+    unsigned char *bytes;
+    size_t period;
+    const char *key;
+    size_t keyLen;
+    int keyedSlot;
+} KeyStream;
+
+/*
+ * One remembered master key: the KDF parameters and salt it came from
+ */
+typedef struct {
+    int used;
+    unsigned char params[8];
+    unsigned char salt[AEAD_SALT_SIZE];
+    unsigned char master[AEAD_KEY_SIZE];
+} KdfCacheEntry;
+
+/*
+ * Everything derived from one passphrase (see keyContextCreate)
+ *   stream: Expanded XOR key stream
+ *   jobSalt: KDF salt of the files this context encrypts (hasJobSalt)
+ *   cache: Master keys derived so far, replaced round-robin
+ *   lock: Guards the salt and the cache; workers share one context
+ */
+typedef struct {
+    KeyStream stream;
+    int hasJobSalt;
+    unsigned char jobSalt[AEAD_SALT_SIZE];
+    KdfCacheEntry cache[KDF_CACHE_SIZE];
+    int cacheNext;
+    MutexHandle lock;
+} KeyContext;
+
+typedef void (*XorKernelFn)(unsigned char *dst, const unsigned char *src,
+                            const unsigned char *stream, size_t len);
+
+typedef struct AeadImpl AeadImpl;
+
+/*
+ * Incremental SHA-256 state
+ */
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char buffer[64];
+    size_t used;
+} Sha256Context;
+
+/*
+ * HMAC-SHA256 state: hashes keyed with the inner and outer pads
+ */
+typedef struct {
+    Sha256Context inner;
+    Sha256Context outer;
+} HmacSha256Context;
+
+/*
+ * A BLAKE3 node up to its last compression, which gives its chaining
+ * value, or the digest if the node turns out to be the root
+ */
+typedef struct {
+    uint32_t cv[8];
+    uint32_t block[16];
+    uint64_t counter;
+    uint32_t blockLen;
+    uint32_t flags;
+} Blake3Output;
+
+/*
+ * Chaining values of the complete subtrees of a BLAKE3 tree, built
+ * from the left one leaf at a time
+ *   count: Leaves pushed so far
+ */
+typedef struct {
+    uint32_t stack[BLAKE3_MAX_DEPTH][8];
+    int depth;
+    uint64_t count;
+} Blake3Tree;
+
+/*
+ * Parsed container header
+ *   cipher: Authenticated cipher of every record
+ *   kdf: Key derivation function (KDF_*) and its parameters
+ *   compression: Codec of compressed records (COMPRESSION_*)
+ *   flags: Container flags (CONTAINER_FLAG_*)
+ *   chunkSize: Plaintext bytes per data record (the last may be shorter)
+ *   kdfSalt: Salt of the master key (shared by the files of one job)
+ *   fileSalt: Salt of this file's key
+ *   bytes: Header as stored; authenticated with every record
+ */
+typedef struct {
+    CipherId cipher;
+    int kdf;
+    int compression;
+    int flags;
+    unsigned char kdfParams[8];
+    uint32_t chunkSize;
+    unsigned char kdfSalt[AEAD_SALT_SIZE];
+    unsigned char fileSalt[AEAD_SALT_SIZE];
+    unsigned char bytes[CONTAINER_HEADER_SIZE];
+} ContainerHeader;
+
+/*
+ * One chunk of the trailing index
+ *   plainOffset, plainLen: Where the chunk's plaintext belongs
+ *   storedOffset, storedLen: Where its record starts, and its payload size
+ *   flags: Record flags
+ *   sequence: Record number (also its nonce)
+ *   hash: Keyed hash of the plaintext (incremental containers only)
+ */
+typedef struct {
+    uint64_t plainOffset;
+    uint64_t storedOffset;
+    uint32_t plainLen;
+    uint32_t storedLen;
+    uint32_t flags;
+    uint64_t sequence;
+    unsigned char hash[CDC_HASH_SIZE];
+} ContainerIndexEntry;
+
+/*
+ * BLAKE3 digest of a container's plaintext (CONTAINER_FLAG_DIGEST),
+ * hashed one BLAKE3_LEAF_SIZE chunk at a time by the task that holds the
+ * chunk anyway, so it costs no pass of its own
+ *   cvs: Chaining value of every leaf but the last, stored by tasks that
+ *        finish in any order; NULL to push leaves onto tree in order
+ *   leaves: Number of leaves of the plaintext (with cvs)
+ *   tree: Leaves so far (without cvs)
+ *   last: Top node of the last leaf, once hasLast is set
+ */
+typedef struct {
+    uint32_t (*cvs)[8];
+    uint64_t leaves;
+    Blake3Tree tree;
+    Blake3Output last;
+    int hasLast;
+} ContainerDigest;
+
+/*
+ * Expanded key of an authenticated cipher
+ *   impl: Implementation that seals and opens with this key
+ *   key: Raw 256-bit key (ChaCha20 uses it directly)
+ *   roundKeys: AES-256 key schedule
+ *   hashPowers: GHASH key powers H..H^8, in the implementation's layout
+ *   hashKaratsuba: High ^ low half of each power, for Karatsuba multiplies
+ */
+typedef struct {
+    const AeadImpl *impl;
+    unsigned char key[AEAD_KEY_SIZE];
+    unsigned char roundKeys[240];
+    unsigned char hashPowers[GCM_HASH_POWERS][16];
+    unsigned char hashKaratsuba[GCM_HASH_POWERS][16];
+} AeadKey;
+
+/*
+ * Random-access reader over one encrypted file (see rangeReaderOpen)
+ *   fd: Open input file
+ *   keyStream, mode: Key and stream mode of an XOR file
+ *   container: 1 for an authenticated container
+ *   header, aead: Container header and file key
+ *   chunkCount, plainSize: Layout found from the footer
+ *   index: Chunk index of a container without fixed layout (NULL otherwise)
+ *   scratch: Buffer for the records of one read, from buffers
+ */
+typedef struct {
+    int fd;
+    const KeyStream *keyStream;
+    CipherMode mode;
+    int container;
+    ContainerHeader header;
+    AeadKey aead;
+    uint64_t chunkCount;
+    uint64_t plainSize;
+    ContainerIndexEntry *index;
+    BufferPool *buffers;
+    unsigned char *scratch;
+} RangeReader;
+
+
+/*
+ * An output written under a temporary name in the directory of its
+ * target and renamed over the target once complete, so a crash or a
+ * failed run never leaves a truncated output behind: readers see the
+ * old file or the new one
+ * A symbolic link is followed, so the file it points to is the one
+ * replaced, and an existing target passes its mode, owner and group on.
+ *   path: Temporary name
+ *   target: Final name (the end of any chain of symbolic links)
+ *   resolved: Storage for target when it is not the name given
+ *   fd: Descriptor of the temporary file
+ */
+typedef struct {
+    char path[MAX_PATH_LENGTH];
+    const char *target;
+    char resolved[MAX_PATH_LENGTH];
+    int fd;
+} OutputFile;
+
+/*
+ * A file pair looked at by the pre-flight checks
+ * The input is opened once and its descriptor handed on to the transfer,
+ * so a file costs one open and one fstat however many checks and
+ * backends look at it.
+ *   fd: Input opened for reading, or -1 (a stream, or not opened yet)
+ *   size: Input size
+ *   blockSize: Preferred I/O block size of the input
+ *   regular: The input is a regular file
+ *   inputStream, outputStream: The side is "-", a pipe, socket or device
+ */
+typedef struct {
+    int fd;
+    uint64_t size;
+    size_t blockSize;
+    int regular;
+    int inputStream;
+    int outputStream;
+} PreparedFile;
+
+/*
+ * XOR kernels in order of preference, narrowest first
+ * `supported` is NULL for kernels that run wherever they are compiled.
+ * `keyed` holds the same ISA's keyed kernels, by xorKeyedLengths slot.
+ */
+typedef struct {
+    const char *name;
+    XorKernelFn fn;
+    int (*supported)();
+    XorKernelFn keyed[XOR_KEYED_COUNT];
+} XorKernelInfo;
+
+typedef void (*Blake3ChunksFn)(const unsigned char *data, size_t chunks, uint64_t counter,
+                               uint32_t (*cvs)[8]);
+
+/*
+ * BLAKE3 chunk hashers in order of preference, narrowest first
+ */
+typedef struct {
+    const char *name;
+    Blake3ChunksFn fn;
+    int (*supported)();
+} Blake3ImplInfo;
+
+/*
+ * AEAD implementations, narrowest first within each cipher
+ * `supported` is NULL for implementations that run wherever they are
+ * compiled; `init` finishes key setup after the AES key schedule.
+ */
+struct AeadImpl {
+    const char *name;
+    CipherId cipher;
+    void (*init)(AeadKey *key);
+    void (*seal)(const AeadKey *key, const unsigned char *nonce, const unsigned char *aad,
+                 size_t aadLen, unsigned char *data, size_t len, unsigned char *tag);
+    int (*open)(const AeadKey *key, const unsigned char *nonce, const unsigned char *aad,
+                size_t aadLen, unsigned char *data, size_t len, const unsigned char *tag);
+    int (*supported)();
+};
+
+// Engine functions used outside file_encrypt.c
+
+// Options, messages and statistics
+FE_INTERNAL void initProcessOptions(ProcessOptions *options);
+FE_INTERNAL int parseIntOption(const char *name, const char *value, long min, long max, int *out);
+FE_INTERNAL int parseCipherName(const char *name, CipherId *cipher);
+FE_INTERNAL int validateKey(const char *key);
+FE_INTERNAL int getHardwareConcurrency();
+FE_INTERNAL int64_t atomicAdd(int64_t *value, int64_t delta);
+FE_INTERNAL void printError(FeStatus status, const char *format, ...);
+FE_INTERNAL void printWarning(FeStatus status, const char *format, ...);
+FE_INTERNAL void statsEnable();
+FE_INTERNAL int statsReport(int format, const char *path);
+
+// Worker pool, buffers and CPU placement
+FE_INTERNAL int createCpuPlacement(const char *cpuList, int numa, CpuPlacement **out);
+FE_INTERNAL BufferPool *bufferPoolCreate(size_t limit, int hugePages);
+FE_INTERNAL void bufferPoolDestroy(BufferPool *pool);
+FE_INTERNAL WorkerPool *poolCreate(int threadCount, size_t scratchSize, BufferPool *buffers,
+                                   const CpuPlacement *placement);
+FE_INTERNAL void poolSubmitLocal(WorkerPool *pool, PoolTaskFn fn, void *arg, uint64_t offset,
+                                 size_t length);
+FE_INTERNAL void poolWaitIdle(WorkerPool *pool);
+FE_INTERNAL void poolDestroy(WorkerPool *pool);
+
+// Files: pre-flight checks, transfers, outputs and range reads
+FE_INTERNAL int prepareInput(int dir, const char *name, const char *path, PreparedFile *prepared);
+FE_INTERNAL void preparedClose(PreparedFile *prepared);
+FE_INTERNAL int checkFilePair(const char *inputFile, const char *outputFile, int outputDir,
+                              const char *outputName, const ProcessOptions *options, int force,
+                              PreparedFile *prepared);
+FE_INTERNAL int joinPath(char *out, size_t outSize, const char *dir, const char *name);
+FE_INTERNAL int writeFull(int fd, const unsigned char *buf, size_t len);
+FE_INTERNAL int outputOpen(OutputFile *out, const char *target, const ProcessOptions *options,
+                           int *ioMode);
+FE_INTERNAL int outputFinish(OutputFile *out, int result, const ProcessOptions *options);
+FE_INTERNAL int transformFile(const char *inputFile, const char *outputFile, KeyContext *keys,
+                              const ProcessOptions *options);
+FE_INTERNAL int transformPrepared(const char *inputFile, const char *outputFile, KeyContext *keys,
+                                  const ProcessOptions *options, PreparedFile *prepared);
+FE_INTERNAL int reserveStdoutForData();
+FE_INTERNAL int rangeReaderOpen(RangeReader *reader, const char *inputFile, KeyContext *keys,
+                                const ProcessOptions *options);
+FE_INTERNAL int rangeReaderRead(RangeReader *reader, uint64_t offset, size_t length, unsigned char *out,
+                                size_t *outLen);
+FE_INTERNAL void rangeReaderClose(RangeReader *reader);
+
+// Keys and the XOR cipher; the use* functions force one implementation,
+// e.g. to benchmark or cross-check them, and NULL restores the automatic
+// choice
+FE_INTERNAL KeyContext *keyContextCreate(const char *key);
+FE_INTERNAL void keyContextDestroy(KeyContext *keys);
+FE_INTERNAL void keyStreamInit(KeyStream *ks, const char *key, size_t keyLen);
+FE_INTERNAL void keyStreamApplyAt(const KeyStream *ks, CipherMode mode, unsigned char *dst,
+                                  const unsigned char *src, size_t len, uint64_t streamOffset);
+FE_INTERNAL void xorCipher(unsigned char *data, size_t dataLen, const char *key, size_t keyLen);
+FE_INTERNAL void xorCipherAt(unsigned char *data, size_t dataLen, const char *key, size_t keyLen,
+                             uint64_t streamOffset);
+FE_INTERNAL const char *xorKernelName();
+FE_INTERNAL int useXorKernel(const char *name);
+FE_INTERNAL int xorKeyedSlot(size_t keyLen);
+FE_INTERNAL void secureZero(void *data, size_t len);
+
+// GPU offload
+FE_INTERNAL GpuBackend *gpuCreate();
+FE_INTERNAL void gpuDestroy(GpuBackend *gpu);
+FE_INTERNAL const char *gpuName(const GpuBackend *gpu);
+
+// Authenticated containers: key derivation, AEADs, BLAKE3 and LZ4
+FE_INTERNAL int scryptDerive(const unsigned char *password, size_t passwordLen,
+                             const unsigned char *salt, size_t saltLen, int logN, int r, int p,
+                             unsigned char *out, size_t outLen);
+FE_INTERNAL int aeadKeyInit(AeadKey *key, CipherId cipher, const unsigned char *rawKey);
+FE_INTERNAL void aeadSeal(const AeadKey *key, const unsigned char *nonce, const unsigned char *aad,
+                          size_t aadLen, unsigned char *data, size_t len, unsigned char *tag);
+FE_INTERNAL int aeadOpen(const AeadKey *key, const unsigned char *nonce, const unsigned char *aad,
+                         size_t aadLen, unsigned char *data, size_t len, const unsigned char *tag);
+FE_INTERNAL const char *aeadImplName(CipherId cipher);
+FE_INTERNAL int useAeadImpl(const char *name);
+FE_INTERNAL void containerHeaderInit(ContainerHeader *header, CipherId cipher, int compression,
+                                     int flags, int kdfCost, const unsigned char *kdfSalt,
+                                     const unsigned char *fileSalt);
+FE_INTERNAL void containerSeal(const AeadKey *aead, const ContainerHeader *header, uint64_t sequence,
+                               uint32_t plainLen, uint32_t storedLen, uint32_t flags,
+                               unsigned char *record);
+FE_INTERNAL void blake3Subtree(const unsigned char *data, size_t len, uint64_t chunkCounter,
+                               Blake3Output *out);
+FE_INTERNAL void blake3OutputCv(const Blake3Output *out, uint32_t *cv);
+FE_INTERNAL void blake3TreeInit(Blake3Tree *tree);
+FE_INTERNAL void blake3TreePush(Blake3Tree *tree, const uint32_t *cv);
+FE_INTERNAL void blake3Hash(const unsigned char *data, size_t len, unsigned char *digest);
+FE_INTERNAL const char *blake3ImplName();
+FE_INTERNAL int useBlake3Impl(const char *name);
+FE_INTERNAL size_t lz4CompressBlock(const unsigned char *src, size_t srcLen, unsigned char *dst,
+                                    size_t capacity);
+FE_INTERNAL int lz4DecompressBlock(const unsigned char *src, size_t srcLen, unsigned char *dst,
+                                   size_t dstLen);
+
+// Implementation tables, in order of preference, and the descriptor that
+// output "-" writes to
+extern FE_INTERNAL const XorKernelInfo xorKernels[];
+extern FE_INTERNAL const size_t xorKernelCount;
+extern FE_INTERNAL const Blake3ImplInfo blake3Impls[];
+extern FE_INTERNAL const size_t blake3ImplCount;
+extern FE_INTERNAL const AeadImpl aeadImpls[];
+extern FE_INTERNAL const size_t aeadImplCount;
+extern FE_INTERNAL int stdoutDataFd;
+
+#endif
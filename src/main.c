@@ -0,0 +1,1339 @@
+/*
+ * File Encryption and Decryption System - command-line front end
+ * The interactive menu, argument parsing and the batch and manifest
+ * runners; everything else is the engine in libfileencrypt.
+ */
+
+#include "file_encrypt_internal.h"
+
+// Commands accepted as the first argument
+#define COMMAND_INTERACTIVE 0
+#define COMMAND_ENCRYPT 1
+#define COMMAND_DECRYPT 2
+
+/*
+ * Non-interactive command and its arguments
+ * Exactly one of key/keyFile is set. batchDir and manifest select batch
+ * mode; outputFile is then the output directory for batchDir. hasRange
+ * limits a decryption to rangeLength bytes from rangeOffset. stats is the
+ * format of the --stats report (STATS_NONE for none), written to
+ * statsFile or, when that is NULL, with the other messages.
+ */
+typedef struct {
+    int command;
+    const char *inputFile;
+    const char *outputFile;
+    const char *key;
+    const char *keyFile;
+    const char *batchDir;
+    const char *manifest;
+    int hasRange;
+    uint64_t rangeOffset;
+    uint64_t rangeLength;
+    int force;
+    int quiet;
+    int stats;
+    const char *statsFile;
+} CommandLine;
+
+// Function prototypes
+static void displayMenu();
+static int getChoice();
+static int getFilename(char *filename, const char *prompt);
+static int getEncryptionKey(char *key);
+static void getCipherMode(ProcessOptions *options);
+static int fileExists(const char *filename);
+static int encryptFile(const char *inputFile, const char *outputFile, const char *key,
+                       const ProcessOptions *options);
+static int decryptFile(const char *inputFile, const char *outputFile, const char *key,
+                       const ProcessOptions *options);
+static int parseArguments(int argc, char *argv[], CommandLine *commandLine, ProcessOptions *options);
+static void printUsage(const char *program);
+static int runInteractive(ProcessOptions *options);
+static int runCommandLine(const CommandLine *commandLine, ProcessOptions *options);
+static int readKeyFile(const char *keyFile, char *key);
+static void clearInputBuffer();
+static void secureKeyInput(char *key, size_t maxLen);
+
+/*
+ * Main function - Entry point of the program
+ * Runs the interactive menu, or a single command when one is given
+ */
+int main(int argc, char *argv[]) {
+    CommandLine commandLine;
+    ProcessOptions options;
+    int status;
+    
+    initProcessOptions(&options);
+    status = parseArguments(argc, argv, &commandLine, &options);
+    if (status != 0) {
+        printUsage(argv[0]);
+        return status < 0 ? 1 : 0;
+    }
+    if (createCpuPlacement(options.cpuList, options.numa, &options.placement) != 0) {
+        return 1;
+    }
+    
+    if (commandLine.command == COMMAND_INTERACTIVE) {
+        status = runInteractive(&options);
+    } else {
+        status = runCommandLine(&commandLine, &options);
+    }
+    free(options.placement);
+    return status;
+}
+
+/*
+ * Interactive menu loop
+ * Parameters:
+ *   options: Processing options from the command line
+ * Returns: Process exit status
+ */
+static int runInteractive(ProcessOptions *options) {
+    char inputFile[MAX_FILENAME_LENGTH];
+    char outputFile[MAX_FILENAME_LENGTH];
+    char key[MAX_KEY_LENGTH];
+    int choice;
+    int result;
+    
+    printf("========================================\n");
+    printf("  FILE ENCRYPTION & DECRYPTION SYSTEM  \n");
+    printf("========================================\n\n");
+    
+    // Main program loop
+    while (1) {
+        displayMenu();
+        choice = getChoice();
+        
+        if (choice == 3) {
+            printf("\nExiting program. Goodbye!\n");
+            break;
+        }
+        
+        // Get input filename
+        if (getFilename(inputFile, "Enter input filename: ") != 0) {
+            continue;
+        }
+        
+        // Check if input file exists
+        if (!fileExists(inputFile)) {
+            printError(FE_ERROR_IO, "File '%s' does not exist!\n", inputFile);
+            continue;
+        }
+        
+        // Get output filename
+        if (getFilename(outputFile, "Enter output filename: ") != 0) {
+            continue;
+        }
+        
+        // Prevent overwriting input file unless transforming in place
+        if (strcmp(inputFile, outputFile) == 0 && !options->inPlace) {
+            printError(FE_ERROR_ARGUMENT, "Output file cannot be the same as input file!\n");
+            printf("       (start with --in-place to transform a file in place)\n");
+            continue;
+        }
+        
+        // Warn if output file exists
+        if (strcmp(inputFile, outputFile) != 0 && fileExists(outputFile)) {
+            char confirm;
+            printf("WARNING: File '%s' already exists. Overwrite? (y/n): ", outputFile);
+            scanf(" %c", &confirm);
+            clearInputBuffer();
+            if (tolower(confirm) != 'y') {
+                printf("Operation cancelled.\n");
+                continue;
+            }
+        }
+        
+        // Get encryption/decryption key
+        if (getEncryptionKey(key) != 0) {
+            continue;
+        }
+        
+        // XOR files do not record their stream mode, so it is asked for
+        getCipherMode(options);
+        
+        // Perform encryption or decryption
+        printf("\nProcessing...\n");
+        
+        if (choice == 1) {
+            result = encryptFile(inputFile, outputFile, key, options);
+            if (result == 0) {
+                printf("\n✓ File encrypted successfully!\n");
+                printf("  Input:  %s\n", inputFile);
+                printf("  Output: %s\n", outputFile);
+            }
+        } else if (choice == 2) {
+            result = decryptFile(inputFile, outputFile, key, options);
+            if (result == 0) {
+                printf("\n✓ File decrypted successfully!\n");
+                printf("  Input:  %s\n", inputFile);
+                printf("  Output: %s\n", outputFile);
+            }
+        }
+        
+        printf("\n");
+    }
+    
+    if (options->pool != NULL) {
+        poolDestroy(options->pool);
+    }
+    return 0;
+}
+
+/*
+ * Parse a byte count with an optional K, M or G suffix (powers of 1024)
+ * Parameters:
+ *   name: Option name, for the error message
+ *   value: Text to parse
+ *   min: Smallest accepted count
+ *   out: Receives the count
+ * Returns: 0 on success, -1 if the value is malformed or too small
+ */
+static int parseSizeOption(const char *name, const char *value, uint64_t min, size_t *out) {
+    char *end;
+    uint64_t parsed = strtoull(value, &end, 10);
+    int shift = 0;
+    
+    if (*end == 'K' || *end == 'k') {
+        shift = 10;
+    } else if (*end == 'M' || *end == 'm') {
+        shift = 20;
+    } else if (*end == 'G' || *end == 'g') {
+        shift = 30;
+    }
+    if (shift > 0) {
+        end++;
+    }
+    if (!isdigit((unsigned char)*value) || *end != '\0' || parsed > (SIZE_MAX >> shift)
+        || (parsed << shift) < min) {
+        printError(FE_ERROR_ARGUMENT, "%s must be a size of at least %llu MiB (suffix K, M or G).\n", name,
+                   (unsigned long long)(min >> 20));
+        return -1;
+    }
+    *out = (size_t)(parsed << shift);
+    return 0;
+}
+
+/*
+ * Parse a --range value: OFFSET:LENGTH, or OFFSET: for the rest of the data
+ * Returns: 0 on success, -1 if the value is malformed (error printed)
+ */
+static int parseRangeOption(const char *value, uint64_t *offset, uint64_t *length) {
+    char *end;
+    
+    *offset = strtoull(value, &end, 10);
+    if (!isdigit((unsigned char)*value) || *end != ':') {
+        printError(FE_ERROR_ARGUMENT, "--range must be OFFSET:LENGTH or OFFSET: (bytes).\n");
+        return -1;
+    }
+    value = end + 1;
+    if (*value == '\0') {
+        *length = UINT64_MAX;
+        return 0;
+    }
+    *length = strtoull(value, &end, 10);
+    if (!isdigit((unsigned char)*value) || *end != '\0') {
+        printError(FE_ERROR_ARGUMENT, "--range must be OFFSET:LENGTH or OFFSET: (bytes).\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Check whether an option takes a value argument
+ */
+static int optionNeedsValue(const char *arg) {
+    static const char *const valued[] = {
+        "-t", "--threads", "--queue-depth", "--progress", "--cipher", "-i", "--input", "-o", "--output",
+        "-k", "--key", "--key-file", "--batch", "--manifest", "--range", "--kdf-cost", "--compress",
+        "--max-memory", "--cpus", "--stats-format", "--stats-file", "--sync", "--gpu-threshold", NULL
+    };
+    
+    for (int i = 0; valued[i] != NULL; i++) {
+        if (strcmp(arg, valued[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Parse command line arguments
+ * The first argument may be a command (encrypt/decrypt); without one the
+ * program runs interactively and only processing options are accepted.
+ * Parameters:
+ *   argc, argv: Arguments passed to main()
+ *   commandLine: Receives the command and its file/key arguments
+ *   options: Processing options to update
+ * Returns: 0 on success, 1 if help was requested, -1 on invalid arguments
+ */
+static int parseArguments(int argc, char *argv[], CommandLine *commandLine, ProcessOptions *options) {
+    int first = 1;
+    
+    memset(commandLine, 0, sizeof(*commandLine));
+    commandLine->command = COMMAND_INTERACTIVE;
+    if (argc > 1 && strcmp(argv[1], "encrypt") == 0) {
+        commandLine->command = COMMAND_ENCRYPT;
+        first = 2;
+    } else if (argc > 1 && strcmp(argv[1], "decrypt") == 0) {
+        commandLine->command = COMMAND_DECRYPT;
+        first = 2;
+    }
+    
+    for (int i = first; i < argc; i++) {
+        const char *arg = argv[i];
+        
+        if (optionNeedsValue(arg) && i + 1 >= argc) {
+            printError(FE_ERROR_ARGUMENT, "%s requires a value.\n", arg);
+            return -1;
+        }
+        
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            return 1;
+        } else if (strcmp(arg, "--threads") == 0 || strcmp(arg, "-t") == 0) {
+            if (parseIntOption("Thread count", argv[++i], 1, MAX_THREADS, &options->threads) != 0) {
+                return -1;
+            }
+        } else if (strcmp(arg, "--queue-depth") == 0) {
+            if (parseIntOption("Queue depth", argv[++i], 1, MAX_QUEUE_DEPTH,
+                               &options->queueDepth) != 0) {
+                return -1;
+            }
+        } else if (strcmp(arg, "--max-memory") == 0) {
+            if (parseSizeOption("--max-memory", argv[++i], MIN_MEMORY_LIMIT, &options->maxMemory) != 0) {
+                return -1;
+            }
+        } else if (strcmp(arg, "--huge-pages") == 0) {
+            options->hugePages = 1;
+        } else if (strcmp(arg, "--cpus") == 0) {
+            options->cpuList = argv[++i];
+        } else if (strcmp(arg, "--numa") == 0) {
+            options->numa = 1;
+        } else if (strcmp(arg, "--async") == 0) {
+            options->asyncIo = 1;
+        } else if (strcmp(arg, "--gpu") == 0) {
+            options->gpu = 1;
+        } else if (strcmp(arg, "--gpu-threshold") == 0) {
+            if (parseSizeOption("--gpu-threshold", argv[++i], MIN_GPU_THRESHOLD, &options->gpuThreshold) != 0) {
+                return -1;
+            }
+        } else if (strcmp(arg, "--direct-io") == 0) {
+            options->directIo = 1;
+        } else if (strcmp(arg, "--drop-cache") == 0) {
+            options->dropCache = 1;
+        } else if (strcmp(arg, "--sync") == 0) {
+            const char *mode = argv[++i];
+            if (strcmp(mode, "none") == 0) {
+                options->syncOutput = 0;
+            } else if (strcmp(mode, "data") == 0) {
+                options->syncOutput = 1;
+            } else {
+                printError(FE_ERROR_ARGUMENT, "--sync must be none or data.\n");
+                return -1;
+            }
+        } else if (strcmp(arg, "--mmap") == 0) {
+            options->useMmap = 1;
+        } else if (strcmp(arg, "--in-place") == 0) {
+            options->useMmap = 1;
+            options->inPlace = 1;
+        } else if (strcmp(arg, "--legacy") == 0) {
+            options->mode = CIPHER_MODE_LEGACY_V1;
+        } else if (strcmp(arg, "--continuous") == 0) {
+            options->mode = CIPHER_MODE_CONTINUOUS_V2;
+        } else if (strcmp(arg, "--cipher") == 0) {
+            if (parseCipherName(argv[++i], &options->cipher) != 0) {
+                printError(FE_ERROR_ARGUMENT, "--cipher must be xor, chacha20-poly1305 or aes-256-gcm.\n");
+                return -1;
+            }
+        } else if (strcmp(arg, "--compress") == 0) {
+            const char *codec = argv[++i];
+            if (strcmp(codec, "lz4") == 0) {
+                options->compression = COMPRESSION_LZ4;
+            } else if (strcmp(codec, "none") == 0) {
+                options->compression = COMPRESSION_NONE;
+            } else {
+                printError(FE_ERROR_ARGUMENT, "--compress must be lz4 or none.\n");
+                return -1;
+            }
+        } else if (strcmp(arg, "--incremental") == 0) {
+            options->incremental = 1;
+        } else if (strcmp(arg, "--kdf-cost") == 0) {
+            if (parseIntOption("KDF cost", argv[++i], MIN_KDF_COST, MAX_KDF_COST,
+                               &options->kdfCost) != 0) {
+                return -1;
+            }
+        } else if (strcmp(arg, "--progress") == 0) {
+            const char *format = argv[++i];
+            if (strcmp(format, "auto") == 0) {
+                options->showProgress = PROGRESS_AUTO;
+            } else if (strcmp(format, "bar") == 0) {
+                options->showProgress = PROGRESS_BAR;
+            } else if (strcmp(format, "machine") == 0) {
+                options->showProgress = PROGRESS_MACHINE;
+            } else if (strcmp(format, "none") == 0) {
+                options->showProgress = PROGRESS_NONE;
+            } else {
+                printError(FE_ERROR_ARGUMENT, "--progress must be auto, bar, machine or none.\n");
+                return -1;
+            }
+        } else if (strcmp(arg, "-q") == 0 || strcmp(arg, "--quiet") == 0) {
+            options->showProgress = PROGRESS_NONE;
+            commandLine->quiet = 1;
+        } else if (strcmp(arg, "-f") == 0 || strcmp(arg, "--force") == 0) {
+            commandLine->force = 1;
+        } else if (commandLine->command == COMMAND_INTERACTIVE) {
+            printError(FE_ERROR_ARGUMENT, "Unknown option '%s'.\n", arg);
+            return -1;
+        } else if (strcmp(arg, "-i") == 0 || strcmp(arg, "--input") == 0) {
+            commandLine->inputFile = argv[++i];
+        } else if (strcmp(arg, "-o") == 0 || strcmp(arg, "--output") == 0) {
+            commandLine->outputFile = argv[++i];
+        } else if (strcmp(arg, "-k") == 0 || strcmp(arg, "--key") == 0) {
+            commandLine->key = argv[++i];
+        } else if (strcmp(arg, "--key-file") == 0) {
+            commandLine->keyFile = argv[++i];
+        } else if (strcmp(arg, "--batch") == 0) {
+            commandLine->batchDir = argv[++i];
+        } else if (strcmp(arg, "--manifest") == 0) {
+            commandLine->manifest = argv[++i];
+        } else if (strcmp(arg, "--range") == 0) {
+            if (parseRangeOption(argv[++i], &commandLine->rangeOffset, &commandLine->rangeLength) != 0) {
+                return -1;
+            }
+            commandLine->hasRange = 1;
+        } else if (strcmp(arg, "--stats") == 0) {
+            if (commandLine->stats == STATS_NONE) {
+                commandLine->stats = STATS_TEXT;
+            }
+        } else if (strcmp(arg, "--stats-format") == 0) {
+            const char *format = argv[++i];
+            if (strcmp(format, "text") == 0) {
+                commandLine->stats = STATS_TEXT;
+            } else if (strcmp(format, "json") == 0) {
+                commandLine->stats = STATS_JSON;
+            } else if (strcmp(format, "prometheus") == 0) {
+                commandLine->stats = STATS_PROMETHEUS;
+            } else {
+                printError(FE_ERROR_ARGUMENT, "--stats-format must be text, json or prometheus.\n");
+                return -1;
+            }
+        } else if (strcmp(arg, "--stats-file") == 0) {
+            commandLine->statsFile = argv[++i];
+            if (commandLine->stats == STATS_NONE) {
+                commandLine->stats = STATS_TEXT;
+            }
+        } else if (strcmp(arg, "--digest") == 0) {
+            options->digest = 1;
+            options->printDigest = 1;
+        } else {
+            printError(FE_ERROR_ARGUMENT, "Unknown option '%s'.\n", arg);
+            return -1;
+        }
+    }
+    
+    if (options->asyncIo && options->useMmap) {
+        printError(FE_ERROR_ARGUMENT, "--async cannot be combined with --mmap or --in-place.\n");
+        return -1;
+    }
+    if ((options->directIo || options->dropCache) && (options->asyncIo || options->useMmap)) {
+        printError(FE_ERROR_ARGUMENT,
+                   "--direct-io and --drop-cache cannot be combined with --async, --mmap or --in-place.\n");
+        return -1;
+    }
+    if (options->gpu && (options->asyncIo || options->useMmap || options->directIo || options->dropCache)) {
+        printError(FE_ERROR_ARGUMENT,
+                   "--gpu cannot be combined with --async, --mmap, --in-place, --direct-io or --drop-cache.\n");
+        return -1;
+    }
+    if (options->gpu && options->cipher != CIPHER_XOR) {
+        printError(FE_ERROR_ARGUMENT, "--gpu only applies to --cipher xor.\n");
+        return -1;
+    }
+    if (options->cipher != CIPHER_XOR
+        && (options->inPlace || options->mode == CIPHER_MODE_CONTINUOUS_V2)) {
+        printError(FE_ERROR_ARGUMENT, "--in-place and --continuous only apply to --cipher xor.\n");
+        return -1;
+    }
+    if (options->cipher == CIPHER_XOR && options->compression != COMPRESSION_NONE) {
+        printError(FE_ERROR_ARGUMENT,
+                   "--compress needs an authenticated --cipher (xor files have no header).\n");
+        return -1;
+    }
+    if (options->incremental && (options->cipher == CIPHER_XOR || commandLine->command != COMMAND_ENCRYPT)) {
+        printError(FE_ERROR_ARGUMENT,
+                   "--incremental only applies to encrypting with an authenticated --cipher.\n");
+        return -1;
+    }
+    if (options->digest && commandLine->command == COMMAND_ENCRYPT
+        && (options->cipher == CIPHER_XOR || options->incremental)) {
+        printError(FE_ERROR_ARGUMENT,
+                   "--digest needs an authenticated --cipher and cannot be combined with --incremental.\n");
+        return -1;
+    }
+    if (commandLine->command == COMMAND_INTERACTIVE) {
+        return 0;
+    }
+    
+    if ((commandLine->key == NULL) == (commandLine->keyFile == NULL)) {
+        printError(FE_ERROR_ARGUMENT, "Give exactly one of -k/--key or --key-file.\n");
+        return -1;
+    }
+    if (commandLine->batchDir != NULL && commandLine->manifest != NULL) {
+        printError(FE_ERROR_ARGUMENT, "--batch and --manifest cannot be combined.\n");
+        return -1;
+    }
+    if (commandLine->hasRange
+        && (commandLine->command != COMMAND_DECRYPT || commandLine->batchDir != NULL
+            || commandLine->manifest != NULL || options->inPlace)) {
+        printError(FE_ERROR_ARGUMENT, "--range only applies to decrypting one file to a new output.\n");
+        return -1;
+    }
+    if (commandLine->manifest != NULL) {
+        if (commandLine->inputFile != NULL || commandLine->outputFile != NULL) {
+            printError(FE_ERROR_ARGUMENT, "-i/-o cannot be combined with --manifest.\n");
+            return -1;
+        }
+    } else if (commandLine->batchDir != NULL) {
+        if (commandLine->inputFile != NULL) {
+            printError(FE_ERROR_ARGUMENT, "-i cannot be combined with --batch.\n");
+            return -1;
+        }
+        if (commandLine->outputFile != NULL && strcmp(commandLine->outputFile, STDIO_PATH) == 0) {
+            printError(FE_ERROR_ARGUMENT, "--batch cannot write to standard output.\n");
+            return -1;
+        }
+        if (commandLine->outputFile == NULL && !options->inPlace) {
+            printError(FE_ERROR_ARGUMENT, "--batch needs an output directory (-o) or --in-place.\n");
+            return -1;
+        }
+    } else if (commandLine->inputFile == NULL
+               || (commandLine->outputFile == NULL && !options->inPlace)) {
+        printError(FE_ERROR_ARGUMENT, "%s needs -i INPUT and -o OUTPUT.\n",
+                   commandLine->command == COMMAND_ENCRYPT ? "encrypt" : "decrypt");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Print command line usage
+ * Parameters:
+ *   program: Program name (argv[0])
+ */
+static void printUsage(const char *program) {
+    printf("Usage: %s [options]                 (interactive menu)\n", program);
+    printf("       %s encrypt|decrypt -i INPUT -o OUTPUT (-k KEY | --key-file FILE) [options]\n",
+           program);
+    printf("       %s encrypt|decrypt --batch DIR -o OUTDIR (-k KEY | --key-file FILE) [options]\n",
+           program);
+    printf("       %s encrypt|decrypt --manifest LIST (-k KEY | --key-file FILE) [options]\n",
+           program);
+    printf("\nCommand options:\n");
+    printf("  -i, --input FILE     Input file (- for standard input)\n");
+    printf("  -o, --output PATH    Output file, - for standard output (directory with --batch)\n");
+    printf("  -k, --key KEY        Encryption key\n");
+    printf("      --key-file FILE  Read the key from the first line of FILE\n");
+    printf("      --batch DIR      Process every regular file in DIR\n");
+    printf("      --manifest LIST  Process \"input<TAB>output\" pairs, one per line\n");
+    printf("      --range OFF:LEN  Decrypt only LEN bytes from offset OFF (OFF: for the rest)\n");
+    printf("  -f, --force          Overwrite existing output files\n");
+    printf("  -q, --quiet          No progress or success messages\n");
+    printf("      --stats          Print time and bytes per stage, queue depths and threads\n");
+    printf("      --stats-format FMT text (default), json or prometheus (implies --stats)\n");
+    printf("      --stats-file FILE Write the --stats report to FILE (json and prometheus\n");
+    printf("                       reports go to standard error otherwise)\n");
+    printf("\nProcessing options:\n");
+    printf("  -t, --threads N      Worker threads (default: %d)\n", getHardwareConcurrency());
+    printf("      --cipher NAME    xor (default), chacha20-poly1305 or aes-256-gcm\n");
+    printf("      --compress CODEC lz4 or none (default): compress authenticated files first\n");
+    printf("      --kdf-cost N     scrypt cost 2^N for new authenticated files (default: %d)\n",
+           DEFAULT_KDF_COST);
+    printf("      --incremental    Update an earlier output, writing only the chunks that changed\n");
+    printf("      --digest         Store (encrypt) or check (decrypt) a BLAKE3 digest and print it\n");
+    printf("      --continuous     Use the phase-continuous v2 stream mode of the xor cipher\n");
+    printf("      --legacy         Use the legacy v1 stream mode of the xor cipher (default)\n");
+    printf("      --mmap           Process files through memory mappings\n");
+    printf("      --in-place       Allow the output to be the input file (implies --mmap)\n");
+    printf("      --async          Overlap disk I/O with the cipher (io_uring on Linux)\n");
+    printf("      --queue-depth N  Reads and writes kept in flight with --async (default: %d)\n",
+           DEFAULT_QUEUE_DEPTH);
+    printf("      --gpu            Run the xor cipher of large files on an OpenCL GPU if there is one\n");
+    printf("      --gpu-threshold SIZE Smallest file --gpu offloads (default: %dM)\n",
+           (int)(DEFAULT_GPU_THRESHOLD >> 20));
+    printf("      --direct-io      Bypass the page cache (O_DIRECT) for bulk jobs\n");
+    printf("      --drop-cache     Evict processed data from the page cache\n");
+    printf("      --sync MODE      none (default) or data: flush each output before it replaces the target\n");
+    printf("      --max-memory SIZE Cap the memory of I/O buffers (e.g. 256M; waits instead)\n");
+    printf("      --huge-pages     Back large buffers with transparent huge pages\n");
+    printf("      --cpus LIST      Pin workers to these CPUs, round robin (e.g. 0-7,16-23)\n");
+    printf("      --numa           Spread workers over NUMA nodes, each on its node's CPUs\n");
+    printf("      --progress FMT   auto (bar on a terminal), bar, machine or none\n");
+}
+
+/*
+ * Display the main menu
+ */
+static void displayMenu() {
+    printf("----------------------------------------\n");
+    printf("1. Encrypt a file\n");
+    printf("2. Decrypt a file\n");
+    printf("3. Exit\n");
+    printf("----------------------------------------\n");
+}
+
+/*
+ * Get user's menu choice with validation
+ * Returns: Valid choice (1-3)
+ */
+static int getChoice() {
+    int choice;
+    
+    while (1) {
+        printf("Enter your choice (1-3): ");
+        int scanned = scanf("%d", &choice);
+        if (scanned == EOF) {
+            // End of input (e.g. a script piped into the menu): exit
+            return 3;
+        }
+        if (scanned != 1) {
+            printError(FE_ERROR_ARGUMENT, "Invalid input. Please enter a number.\n");
+            clearInputBuffer();
+            continue;
+        }
+        clearInputBuffer();
+        
+        if (choice >= 1 && choice <= 3) {
+            return choice;
+        }
+        printError(FE_ERROR_ARGUMENT, "Invalid choice. Please enter 1, 2, or 3.\n");
+    }
+}
+
+/*
+ * Get filename from user with validation
+ * Parameters:
+ *   filename: Buffer to store the filename
+ *   prompt: Prompt message to display
+ * Returns: 0 on success, -1 on failure
+ */
+static int getFilename(char *filename, const char *prompt) {
+    printf("%s", prompt);
+    if (fgets(filename, MAX_FILENAME_LENGTH, stdin) == NULL) {
+        printError(FE_ERROR_IO, "Failed to read filename.\n");
+        return -1;
+    }
+    
+    // Remove newline character
+    size_t len = strlen(filename);
+    if (len > 0 && filename[len - 1] == '\n') {
+        filename[len - 1] = '\0';
+        len--;
+    }
+    
+    // Validate filename length
+    if (len == 0) {
+        printError(FE_ERROR_ARGUMENT, "Filename cannot be empty.\n");
+        return -1;
+    }
+    
+    return 0;
+}
+
+/*
+ * Get encryption key from user with validation
+ * Parameters:
+ *   key: Buffer to store the key
+ * Returns: 0 on success, -1 on failure
+ */
+static int getEncryptionKey(char *key) {
+    printf("Enter encryption key (min %d chars): ", MIN_KEY_LENGTH);
+    secureKeyInput(key, MAX_KEY_LENGTH);
+    
+    if (validateKey(key) != 0) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+/*
+ * Ask which cipher (and, for XOR, which stream mode) to use
+ * The XOR modes are offered by name, not by format version, so the menu
+ * numbers cannot be mistaken for versions. An empty answer selects XOR
+ * with DEFAULT_CIPHER_MODE.
+ * Parameters:
+ *   options: Receives cipher and mode
+ */
+static void getCipherMode(ProcessOptions *options) {
+    char line[16];
+    
+    while (1) {
+        printf("Cipher (1 = XOR legacy, 2 = XOR continuous, 3 = ChaCha20-Poly1305, 4 = AES-256-GCM) [1]: ");
+        if (fgets(line, sizeof(line), stdin) == NULL) {
+            line[0] = '\0';
+        } else if (strchr(line, '\n') == NULL) {
+            clearInputBuffer();
+        }
+        
+        options->cipher = CIPHER_XOR;
+        options->mode = DEFAULT_CIPHER_MODE;
+        if (line[0] == '\n' || line[0] == '\0' || line[0] == '1') {
+            return;
+        }
+        if (line[0] == '2') {
+            options->mode = CIPHER_MODE_CONTINUOUS_V2;
+            return;
+        }
+        if (line[0] == '3') {
+            options->cipher = CIPHER_CHACHA20_POLY1305;
+            return;
+        }
+        if (line[0] == '4') {
+            options->cipher = CIPHER_AES_256_GCM;
+            return;
+        }
+        printError(FE_ERROR_ARGUMENT, "Invalid choice. Please enter 1 to 4.\n");
+    }
+}
+
+/*
+ * Secure key input (prevents echoing to screen)
+ * Parameters:
+ *   key: Buffer to store the key
+ *   maxLen: Maximum length of the key
+ */
+static void secureKeyInput(char *key, size_t maxLen) {
+    // For cross-platform compatibility, using standard input
+    // In production, use platform-specific secure input methods
+    if (fgets(key, maxLen, stdin) == NULL) {
+        key[0] = '\0';
+        return;
+    }
+    
+    // Remove newline
+    size_t len = strlen(key);
+    if (len > 0 && key[len - 1] == '\n') {
+        key[len - 1] = '\0';
+    }
+}
+
+/*
+ * Check if file exists
+ * A stat, not an open: nothing is read and no descriptor is taken.
+ * Parameters:
+ *   filename: Name of the file to check
+ * Returns: 1 if exists, 0 if not
+ */
+static int fileExists(const char *filename) {
+#ifdef _WIN32
+    struct _stat64 st;
+    return _stat64(filename, &st) == 0;
+#else
+    struct stat st;
+    return stat(filename, &st) == 0;
+#endif
+}
+
+/*
+ * Read a key from the first line of a file
+ * Parameters:
+ *   keyFile: Name of the key file
+ *   key: Buffer of MAX_KEY_LENGTH bytes
+ * Returns: 0 on success, -1 on failure
+ */
+static int readKeyFile(const char *keyFile, char *key) {
+    FILE *file = fopen(keyFile, "rb");
+    size_t len;
+    
+    if (file == NULL) {
+        printError(FE_ERROR_IO, "Cannot open key file '%s': %s\n", keyFile, strerror(errno));
+        return -1;
+    }
+    if (fgets(key, MAX_KEY_LENGTH, file) == NULL) {
+        key[0] = '\0';
+    }
+    fclose(file);
+    
+    len = strlen(key);
+    while (len > 0 && (key[len - 1] == '\n' || key[len - 1] == '\r')) {
+        key[--len] = '\0';
+    }
+    return 0;
+}
+
+/*
+ * Decrypt a byte range of a file to an output path (decrypt --range)
+ * Parameters:
+ *   inputFile: Encrypted regular file
+ *   outputFile: Output file, or "-" for standard output
+ *   keys: Key context
+ *   options: Processing options
+ *   offset, length: Plaintext range; it is cut short at the end of the data
+ * Returns: 0 on success, -1 on failure
+ */
+static int decryptRangeToPath(const char *inputFile, const char *outputFile,
+                              KeyContext *keys, const ProcessOptions *options,
+                              uint64_t offset, uint64_t length) {
+    RangeReader reader;
+    unsigned char *buffer;
+    int toStdout = strcmp(outputFile, STDIO_PATH) == 0;
+    OutputFile out;
+    int outFd;
+    int result = 0;
+    
+    if (rangeReaderOpen(&reader, inputFile, keys, options) != 0) {
+        return -1;
+    }
+    buffer = (unsigned char *)malloc(STREAM_BUFFER_SIZE);
+    if (buffer == NULL) {
+        printError(FE_ERROR_MEMORY, "Out of memory.\n");
+        rangeReaderClose(&reader);
+        return -1;
+    }
+    if (toStdout) {
+        outFd = stdoutDataFd;
+    } else if (outputOpen(&out, outputFile, options, NULL) == 0) {
+        outFd = out.fd;
+    } else {
+        outFd = -1;
+    }
+    if (outFd < 0) {
+        printError(FE_ERROR_IO, "Cannot create output file '%s': %s\n", outputFile, strerror(errno));
+        free(buffer);
+        rangeReaderClose(&reader);
+        return -1;
+    }
+    
+    do {
+        size_t want = length < STREAM_BUFFER_SIZE ? (size_t)length : STREAM_BUFFER_SIZE;
+        size_t got;
+        if (rangeReaderRead(&reader, offset, want, buffer, &got) != 0) {
+            result = -1;
+            break;
+        }
+        if (got > 0 && writeFull(outFd, buffer, got) != 0) {
+            printError(FE_ERROR_IO, "Write operation failed: %s\n", strerror(errno));
+            result = -1;
+            break;
+        }
+        offset += got;
+        length -= got;
+        if (got < want) {
+            break;
+        }
+    } while (length > 0);
+    
+    if (!toStdout) {
+        result = outputFinish(&out, result, options);
+    }
+    free(buffer);
+    rangeReaderClose(&reader);
+    return result;
+}
+
+/*
+ * Progress of a batch run; the counts are updated by workers with atomics
+ */
+typedef struct {
+    KeyContext *keys;
+    const ProcessOptions *fileOptions;
+    int64_t succeeded;
+    int64_t failed;
+    int64_t openInputs;
+    int64_t openLimit;
+} BatchState;
+
+/*
+ * Count one finished file of a batch
+ */
+static void batchCount(BatchState *batch, int result) {
+    atomicAdd(result == 0 ? &batch->succeeded : &batch->failed, 1);
+}
+
+/*
+ * One small file queued as a single pool task
+ */
+typedef struct {
+    BatchState *batch;
+    char *inputFile;
+    char *outputFile;
+    PreparedFile prepared;
+} BatchFileTask;
+
+/*
+ * Pool task: process one whole file on the worker that picks it up
+ */
+static void batchFileTask(void *arg, uint64_t offset, size_t length, unsigned char *scratch) {
+    BatchFileTask *task = (BatchFileTask *)arg;
+    BatchState *batch = task->batch;
+    int result;
+    
+    (void)offset;
+    (void)length;
+    (void)scratch;
+    if (task->prepared.fd >= 0) {
+        result = transformPrepared(task->inputFile, task->outputFile, batch->keys, batch->fileOptions,
+                                   &task->prepared);
+        atomicAdd(&batch->openInputs, -1);
+    } else {
+        result = transformFile(task->inputFile, task->outputFile, batch->keys, batch->fileOptions);
+    }
+    batchCount(batch, result);
+    
+    free(task->inputFile);
+    free(task->outputFile);
+    free(task);
+}
+
+/*
+ * Apply checkFilePair() to a pair named on the command line
+ * An output that exists gets a hint about --force, which the engine's
+ * message leaves out as library callers set FeConfig.overwrite instead.
+ */
+static int checkCommandPair(const char *inputFile, const char *outputFile, int outputDir,
+                            const char *outputName, const ProcessOptions *options, int force,
+                            PreparedFile *prepared) {
+    if (checkFilePair(inputFile, outputFile, outputDir, outputName, options, force, prepared) != 0) {
+        if (errno == EEXIST) {
+            printf("       (use --force to overwrite)\n");
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Duplicate a string
+ * Returns: Heap copy, or NULL if out of memory
+ */
+static char *copyString(const char *text) {
+    size_t len = strlen(text) + 1;
+    char *copy = (char *)malloc(len);
+    if (copy != NULL) {
+        memcpy(copy, text, len);
+    }
+    return copy;
+}
+
+/*
+ * Process one file of a batch
+ * The checks and size probe run on the calling thread, so the workers
+ * only move data. Files that fit in one segment are queued whole on the
+ * workers' own queues, where idle workers steal them, so many small files
+ * run side by side; larger ones are split into segments on the shared
+ * queue of the same pool by the calling thread, which workers serve
+ * first, and the small files queued before them fill the gaps.
+ * Parameters:
+ *   outputDir, outputName: Where to look the output up (see checkFilePair)
+ *   prepared: Input opened by the caller, or fd -1 to open it here
+ */
+static void batchProcessFile(BatchState *batch, const char *inputFile, const char *outputFile,
+                             int outputDir, const char *outputName, PreparedFile *prepared,
+                             const ProcessOptions *options, int force) {
+    if (checkCommandPair(inputFile, outputFile, outputDir, outputName, options, force, prepared) != 0) {
+        batchCount(batch, -1);
+        return;
+    }
+    
+    if (options->pool != NULL && prepared->regular && prepared->size <= PARALLEL_SEGMENT_SIZE) {
+        BatchFileTask *task = (BatchFileTask *)malloc(sizeof(BatchFileTask));
+        if (task != NULL) {
+            task->batch = batch;
+            task->inputFile = copyString(inputFile);
+            task->outputFile = copyString(outputFile);
+            task->prepared = *prepared;
+            if (task->inputFile != NULL && task->outputFile != NULL) {
+                if (atomicAdd(&batch->openInputs, 1) > batch->openLimit) {
+                    atomicAdd(&batch->openInputs, -1);
+                    preparedClose(&task->prepared);
+                }
+                poolSubmitLocal(options->pool, batchFileTask, task, 0, 0);
+                return;
+            }
+            free(task->inputFile);
+            free(task->outputFile);
+            free(task);
+        }
+    }
+    
+    batchCount(batch, transformPrepared(inputFile, outputFile, batch->keys, options, prepared));
+}
+
+/*
+ * Create a directory if it does not exist yet
+ * Returns: 0 on success, -1 on failure
+ */
+static int ensureDirectory(const char *dir) {
+#ifdef _WIN32
+    if (_mkdir(dir) == 0 || errno == EEXIST) {
+        return 0;
+    }
+#else
+    if (mkdir(dir, 0777) == 0 || errno == EEXIST) {
+        return 0;
+    }
+#endif
+    printError(FE_ERROR_IO, "Cannot create directory '%s': %s\n", dir, strerror(errno));
+    return -1;
+}
+
+/*
+ * Process every regular file directly inside a directory
+ * Inputs are opened and outputs looked up relative to descriptors of the
+ * two directories (openat), and entries the listing types as anything but
+ * a file or link are skipped unopened.
+ * Returns: 0 on success, -1 if the directory cannot be read
+ */
+static int runBatchDirectory(BatchState *batch, const char *inputDir, const char *outputDir,
+                             const ProcessOptions *options, int force) {
+    char inputPath[MAX_PATH_LENGTH];
+    char outputPath[MAX_PATH_LENGTH];
+    PreparedFile prepared;
+    
+    if (outputDir != NULL && ensureDirectory(outputDir) != 0) {
+        return -1;
+    }
+    
+#ifdef _WIN32
+    WIN32_FIND_DATAA entry;
+    char pattern[MAX_PATH_LENGTH];
+    HANDLE find;
+    
+    if (joinPath(pattern, sizeof(pattern), inputDir, "*") != 0) {
+        printError(FE_ERROR_ARGUMENT, "Path too long: %s\n", inputDir);
+        return -1;
+    }
+    find = FindFirstFileA(pattern, &entry);
+    if (find == INVALID_HANDLE_VALUE) {
+        printError(FE_ERROR_IO, "Cannot read directory '%s'.\n", inputDir);
+        return -1;
+    }
+    do {
+        const char *name = entry.cFileName;
+        if (entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            continue;
+        }
+#else
+    DIR *dir = opendir(inputDir);
+    struct dirent *entry;
+    int inputFd;
+    int outputFd;
+    
+    if (dir == NULL) {
+        printError(FE_ERROR_IO, "Cannot read directory '%s': %s\n", inputDir, strerror(errno));
+        return -1;
+    }
+    inputFd = dirfd(dir);
+    outputFd = outputDir != NULL ? open(outputDir, O_RDONLY | O_DIRECTORY) : inputFd;
+    if (outputFd < 0) {
+        printError(FE_ERROR_IO, "Cannot read directory '%s': %s\n", outputDir, strerror(errno));
+        closedir(dir);
+        return -1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+#ifdef DT_REG
+        if (entry->d_type != DT_REG && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN) {
+            continue;
+        }
+#endif
+#endif
+        if (joinPath(inputPath, sizeof(inputPath), inputDir, name) != 0
+            || joinPath(outputPath, sizeof(outputPath), outputDir != NULL ? outputDir : inputDir,
+                        name) != 0) {
+            printError(FE_ERROR_ARGUMENT, "Path too long: %s\n", name);
+            batchCount(batch, -1);
+            continue;
+        }
+#ifdef _WIN32
+        if (prepareInput(FE_CWD, inputPath, inputPath, &prepared) != 0) {
+            printError(FE_ERROR_IO, "Cannot open input file '%s': %s\n", inputPath, strerror(errno));
+            batchCount(batch, -1);
+            continue;
+        }
+        if (!prepared.regular) {
+            preparedClose(&prepared);
+            continue;
+        }
+        batchProcessFile(batch, inputPath, outputPath, FE_CWD, outputPath, &prepared, options, force);
+    } while (FindNextFileA(find, &entry));
+    FindClose(find);
+#else
+        // Links and untyped entries are only known once open
+        if (prepareInput(inputFd, name, inputPath, &prepared) != 0) {
+            if (errno != ENOENT) {
+                printError(FE_ERROR_IO, "Cannot open input file '%s': %s\n", inputPath, strerror(errno));
+                batchCount(batch, -1);
+            }
+            continue;
+        }
+        if (!prepared.regular) {
+            preparedClose(&prepared);
+            continue;
+        }
+        batchProcessFile(batch, inputPath, outputPath, outputFd, name, &prepared, options, force);
+    }
+    if (outputFd != inputFd) {
+        close(outputFd);
+    }
+    closedir(dir);
+#endif
+    return 0;
+}
+
+/*
+ * Process the "input<TAB>output" pairs listed in a manifest file
+ * Blank lines and lines starting with '#' are skipped.
+ * Returns: 0 on success, -1 if the manifest cannot be read
+ */
+static int runBatchManifest(BatchState *batch, const char *manifest,
+                            const ProcessOptions *options, int force) {
+    char line[2 * MAX_PATH_LENGTH];
+    FILE *file = fopen(manifest, "r");
+    size_t lineNumber = 0;
+    PreparedFile prepared;
+    
+    if (file == NULL) {
+        printError(FE_ERROR_IO, "Cannot open manifest '%s': %s\n", manifest, strerror(errno));
+        return -1;
+    }
+    
+    while (fgets(line, sizeof(line), file) != NULL) {
+        size_t len = strlen(line);
+        char *tab;
+        
+        lineNumber++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+        
+        tab = strchr(line, '\t');
+        if (tab == NULL || tab == line || tab[1] == '\0') {
+            printError(FE_ERROR_ARGUMENT, "%s:%lu: expected \"input<TAB>output\".\n", manifest,
+                       (unsigned long)lineNumber);
+            batchCount(batch, -1);
+            continue;
+        }
+        *tab = '\0';
+        prepared.fd = -1;
+        prepared.inputStream = 0;
+        batchProcessFile(batch, line, tab + 1, FE_CWD, tab + 1, &prepared, options, force);
+    }
+    
+    fclose(file);
+    return 0;
+}
+
+/*
+ * Run a non-interactive encrypt/decrypt command
+ * Parameters:
+ *   commandLine: Parsed command
+ *   options: Processing options
+ * Returns: Process exit status (0 if every file succeeded)
+ */
+static int runCommandLine(const CommandLine *commandLine, ProcessOptions *options) {
+    char key[MAX_KEY_LENGTH];
+    int decrypt = commandLine->command == COMMAND_DECRYPT;
+    int batchMode = commandLine->batchDir != NULL || commandLine->manifest != NULL;
+    int status = 0;
+    KeyContext *keys;
+    
+    // Messages must not interleave with data written to standard output
+    if (commandLine->outputFile != NULL && strcmp(commandLine->outputFile, STDIO_PATH) == 0
+        && reserveStdoutForData() != 0) {
+        printError(FE_ERROR_IO, "Cannot redirect messages to standard error: %s\n", strerror(errno));
+        return 1;
+    }
+    
+    if (commandLine->keyFile != NULL) {
+        if (readKeyFile(commandLine->keyFile, key) != 0) {
+            return 1;
+        }
+    } else {
+        if (strlen(commandLine->key) >= MAX_KEY_LENGTH) {
+            printError(FE_ERROR_ARGUMENT, "Key is too long (max %d characters).\n", MAX_KEY_LENGTH - 1);
+            return 1;
+        }
+        strcpy(key, commandLine->key);
+    }
+    if (validateKey(key) != 0) {
+        return 1;
+    }
+    options->decrypt = decrypt;
+    if (commandLine->stats != STATS_NONE) {
+        statsEnable();
+    }
+    
+    // The expanded key and derived master keys are shared by every file
+    // of the run
+    keys = keyContextCreate(key);
+    if (keys == NULL) {
+        printError(FE_ERROR_MEMORY, "Out of memory.\n");
+        return 1;
+    }
+    
+    // Buffers are reused across the files of the run and capped together;
+    // workers take scratch only for segments, not for whole-file tasks
+    options->buffers = bufferPoolCreate(options->maxMemory, options->hugePages);
+    if (options->buffers == NULL) {
+        printError(FE_ERROR_MEMORY, "Out of memory.\n");
+        keyContextDestroy(keys);
+        return 1;
+    }
+    if (options->threads > 1) {
+        options->pool = poolCreate(options->threads, PARALLEL_SEGMENT_SIZE, options->buffers,
+                                   options->placement);
+        if (options->pool == NULL) {
+            printError(FE_ERROR_SYSTEM, "Cannot start worker threads.\n");
+            bufferPoolDestroy(options->buffers);
+            options->buffers = NULL;
+            keyContextDestroy(keys);
+            return 1;
+        }
+    }
+    if (options->gpu) {
+        options->gpuBackend = gpuCreate();
+        if (options->gpuBackend == NULL) {
+            printWarning(FE_OK, "No OpenCL GPU is available; --gpu falls back to the CPU.\n");
+        }
+    }
+    
+    if (batchMode) {
+        ProcessOptions fileOptions = *options;
+        BatchState batch;
+        
+        // Per-file progress bars are meaningless when files run side by side
+        options->showProgress = 0;
+        
+        // Whole-file tasks already run on a worker: no nested pool, no
+        // extra I/O threads
+        fileOptions.threads = 1;
+        fileOptions.pool = NULL;
+        fileOptions.asyncIo = 0;
+        fileOptions.showProgress = 0;
+        
+        memset(&batch, 0, sizeof(batch));
+        batch.keys = keys;
+        batch.fileOptions = &fileOptions;
+        batch.openLimit = BATCH_OPEN_INPUTS;
+#ifndef _WIN32
+        struct rlimit files;
+        if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur != RLIM_INFINITY
+            && files.rlim_cur / 4 < (rlim_t)batch.openLimit) {
+            batch.openLimit = (int64_t)(files.rlim_cur / 4);
+        }
+#endif
+        
+        if (commandLine->batchDir != NULL) {
+            status = runBatchDirectory(&batch, commandLine->batchDir, commandLine->outputFile,
+                                       options, commandLine->force);
+        } else {
+            status = runBatchManifest(&batch, commandLine->manifest, options, commandLine->force);
+        }
+        if (options->pool != NULL) {
+            poolWaitIdle(options->pool);
+        }
+        
+        if (!commandLine->quiet || batch.failed > 0) {
+            printf("%s %lu file(s), %lu failed.\n", decrypt ? "Decrypted" : "Encrypted",
+                   (unsigned long)batch.succeeded, (unsigned long)batch.failed);
+        }
+        if (batch.failed > 0) {
+            status = -1;
+        }
+    } else {
+        const char *outputFile = commandLine->outputFile != NULL
+                                 ? commandLine->outputFile : commandLine->inputFile;
+        
+        PreparedFile prepared;
+        
+        prepared.fd = -1;
+        prepared.inputStream = 0;
+        status = checkCommandPair(commandLine->inputFile, outputFile, FE_CWD, outputFile, options,
+                                  commandLine->force, &prepared);
+        if (status == 0 && commandLine->hasRange) {
+            preparedClose(&prepared);
+            status = decryptRangeToPath(commandLine->inputFile, outputFile, keys, options,
+                                        commandLine->rangeOffset, commandLine->rangeLength);
+        } else if (status == 0) {
+            status = transformPrepared(commandLine->inputFile, outputFile, keys, options, &prepared);
+        }
+        if (status == 0 && !commandLine->quiet) {
+            printf("\n✓ File %s successfully!\n", decrypt ? "decrypted" : "encrypted");
+            printf("  Input:  %s\n", commandLine->inputFile);
+            printf("  Output: %s\n", outputFile);
+        }
+    }
+    if (commandLine->stats != STATS_NONE && statsReport(commandLine->stats, commandLine->statsFile) != 0) {
+        status = -1;
+    }
+    
+    if (options->pool != NULL) {
+        poolDestroy(options->pool);
+        options->pool = NULL;
+    }
+    gpuDestroy(options->gpuBackend);
+    options->gpuBackend = NULL;
+    bufferPoolDestroy(options->buffers);
+    options->buffers = NULL;
+    keyContextDestroy(keys);
+    return status == 0 ? 0 : 1;
+}
+
+/*
+ * Encrypt a file using XOR cipher
+ * Parameters:
+ *   inputFile: Name of the input file
+ *   outputFile: Name of the output file
+ *   key: Encryption key
+ *   options: Processing options
+ * Returns: 0 on success, -1 on failure
+ */
+static int encryptFile(const char *inputFile, const char *outputFile, const char *key,
+                       const ProcessOptions *options) {
+    KeyContext *keys = keyContextCreate(key);
+    int result;
+    
+    // Expand the key once for the whole file
+    if (keys == NULL) {
+        printError(FE_ERROR_MEMORY, "Out of memory.\n");
+        return -1;
+    }
+    result = transformFile(inputFile, outputFile, keys, options);
+    keyContextDestroy(keys);
+    return result;
+}
+
+/*
+ * Decrypt a file
+ * XOR is symmetric, so only the authenticated ciphers care about the
+ * direction
+ * Parameters:
+ *   inputFile: Name of the input file
+ *   outputFile: Name of the output file
+ *   key: Decryption key
+ *   options: Processing options (cipher and mode must match the ones used to encrypt)
+ * Returns: 0 on success, -1 on failure
+ */
+static int decryptFile(const char *inputFile, const char *outputFile, const char *key,
+                       const ProcessOptions *options) {
+    ProcessOptions decryptOptions = *options;
+    
+    decryptOptions.decrypt = 1;
+    return encryptFile(inputFile, outputFile, key, &decryptOptions);
+}
+
+/*
+ * Clear input buffer to remove extra characters
+ */
+static void clearInputBuffer() {
+    int c;
+    while ((c = getchar()) != '\n' && c != EOF);
+}
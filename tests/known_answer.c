@@ -0,0 +1,408 @@
+/*
+ * Known-answer tests for the file encryption engine
+ * Checks every compiled implementation of the XOR kernels, the AEAD
+ * ciphers and the BLAKE3 chunk hasher against published reference vectors
+ * (RFC 8439, the GCM specification's AES-256 cases, RFC 7914, BLAKE3),
+ * cross-checks the AEAD implementations against the portable ones on
+ * lengths the short vectors do not reach, and round-trips LZ4 blocks.
+ * Implementations the CPU cannot run are reported and skipped.
+ * Exits with 1 if any check fails.
+ */
+
+#include "file_encrypt_internal.h"
+
+static int failures = 0;
+
+/*
+ * Record one check; prints the failing ones
+ */
+static void check(int ok, const char *what, const char *impl, size_t detail) {
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s (%s, %lu)\n", what, impl, (unsigned long)detail);
+        failures++;
+    }
+}
+
+/*
+ * Decode a hex string into bytes
+ * Returns: Number of bytes written
+ */
+static size_t fromHex(const char *hex, unsigned char *out) {
+    size_t n = 0;
+    for (; hex[0] != '\0' && hex[1] != '\0'; hex += 2) {
+        unsigned int byte;
+        sscanf(hex, "%2x", &byte);
+        out[n++] = (unsigned char)byte;
+    }
+    return n;
+}
+
+/*
+ * Fill a buffer with cheap pseudo-random bytes
+ */
+static void fillRandom(unsigned char *data, size_t len, uint64_t seed) {
+    uint64_t x = seed | 1;
+    for (size_t i = 0; i < len; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        data[i] = (unsigned char)x;
+    }
+}
+
+/*
+ * Every kernel against the byte-at-a-time definition: byte n of the
+ * stream is XORed with key[n % keyLen]. The key lengths cover the keyed
+ * kernels (16, 32, 64) and the generic period loop on either side.
+ */
+static void testXor() {
+    static const size_t keyLens[] = { 1, 3, 5, 15, 16, 17, 31, 32, 33, 64, 65, 100, 255 };
+    static const size_t lengths[] = { 0, 1, 7, 31, 64, 127, 1000, 4096, 70001 };
+    static const uint64_t offsets[] = { 0, 1, 13, 4095, (uint64_t)1 << 33 };
+    size_t maxLen = 70001;
+    unsigned char *data = (unsigned char *)malloc(maxLen);
+    unsigned char *expected = (unsigned char *)malloc(maxLen);
+    char key[256];
+
+    if (data == NULL || expected == NULL) {
+        check(0, "xor: out of memory", "-", 0);
+        free(data);
+        free(expected);
+        return;
+    }
+    fillRandom((unsigned char *)key, sizeof(key), 3);
+    for (size_t k = 0; k < xorKernelCount; k++) {
+        const char *name = xorKernels[k].name;
+        if (useXorKernel(name) != 0) {
+            printf("skip: xor %s (not supported by this CPU)\n", name);
+            continue;
+        }
+        for (size_t a = 0; a < sizeof(keyLens) / sizeof(keyLens[0]); a++) {
+            for (size_t b = 0; b < sizeof(lengths) / sizeof(lengths[0]); b++) {
+                for (size_t c = 0; c < sizeof(offsets) / sizeof(offsets[0]); c++) {
+                    size_t keyLen = keyLens[a];
+                    size_t len = lengths[b];
+                    uint64_t offset = offsets[c];
+
+                    fillRandom(data, len, len + 5);
+                    for (size_t i = 0; i < len; i++) {
+                        expected[i] = data[i] ^ (unsigned char)key[(offset + i) % keyLen];
+                    }
+                    xorCipherAt(data, len, key, keyLen, offset);
+                    check(memcmp(data, expected, len) == 0, "xorCipherAt", name, keyLen * 1000000 + len);
+                }
+                fillRandom(data, lengths[b], 9);
+                memcpy(expected, data, lengths[b]);
+                xorCipher(data, lengths[b], key, keyLens[a]);
+                xorCipher(data, lengths[b], key, keyLens[a]);
+                check(memcmp(data, expected, lengths[b]) == 0, "xorCipher round trip", name, keyLens[a]);
+            }
+        }
+        printf("ok: xor %s\n", name);
+    }
+    free(data);
+    free(expected);
+}
+
+/*
+ * One AEAD reference vector (hex strings)
+ */
+typedef struct {
+    CipherId cipher;
+    const char *source;
+    const char *key;
+    const char *nonce;
+    const char *aad;
+    const char *plain;
+    const char *cipherText;
+    const char *tag;
+} AeadVector;
+
+static const AeadVector aeadVectors[] = {
+    // RFC 8439 section 2.8.2
+    { CIPHER_CHACHA20_POLY1305, "RFC 8439 2.8.2",
+      "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f",
+      "070000004041424344454647", "50515253c0c1c2c3c4c5c6c7",
+      "4c616469657320616e642047656e746c656d656e206f662074686520636c617373206f66202739393a"
+      "204966204920636f756c64206f6666657220796f75206f6e6c79206f6e652074697020666f72207468"
+      "65206675747572652c2073756e73637265656e20776f756c642062652069742e",
+      "d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d63dbea45e8ca9671282fafb"
+      "69da92728b1a71de0a9e060b2905d6a5b67ecd3b3692ddbd7f2d778b8c9803aee328091b58fab324e4fa"
+      "d675945585808b4831d7bc3ff4def08e4b7a9de576d26586cec64b6116",
+      "1ae10b594f09e26a7e902ecbd0600691" },
+    // GCM specification (McGrew and Viega), test cases 13 to 16
+    { CIPHER_AES_256_GCM, "GCM test case 13",
+      "0000000000000000000000000000000000000000000000000000000000000000",
+      "000000000000000000000000", "", "", "",
+      "530f8afbc74536b9a963b4f1c4cb738b" },
+    { CIPHER_AES_256_GCM, "GCM test case 14",
+      "0000000000000000000000000000000000000000000000000000000000000000",
+      "000000000000000000000000", "", "00000000000000000000000000000000",
+      "cea7403d4d606b6e074ec5d3baf39d18", "d0d1c8a799996bf0265b98b5d48ab919" },
+    { CIPHER_AES_256_GCM, "GCM test case 15",
+      "feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308",
+      "cafebabefacedbaddecaf888", "",
+      "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e24"
+      "49a6b525b16aedf5aa0de657ba637b391aafd255",
+      "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa8cb08e48590dbb3da7b08b10"
+      "56828838c5f61e6393ba7a0abcc9f662898015ad",
+      "b094dac5d93471bdec1a502270e3cc6c" },
+    { CIPHER_AES_256_GCM, "GCM test case 16",
+      "feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308",
+      "cafebabefacedbaddecaf888", "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+      "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e24"
+      "49a6b525b16aedf5aa0de657ba637b39",
+      "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa8cb08e48590dbb3da7b08b10"
+      "56828838c5f61e6393ba7a0abcc9f662",
+      "76fc6ece0f4e1768cddf8853bb2d551b" },
+};
+
+/*
+ * Name of the portable implementation of a cipher
+ */
+static const char *aeadPortableName(CipherId cipher) {
+    return cipher == CIPHER_AES_256_GCM ? "aes-256-gcm-portable" : "chacha20-poly1305-portable";
+}
+
+/*
+ * Every AEAD implementation on the reference vectors of its cipher, then
+ * against the portable implementation on random data of awkward lengths
+ * (up to a whole container chunk, which the wide paths need), with a
+ * forged tag and flipped ciphertext rejected each time
+ */
+static void testAead() {
+    static const size_t lengths[] = { 0, 1, 15, 16, 17, 63, 64, 65, 127, 128, 129, 255, 256, 257,
+                                      1000, 4103, AEAD_CHUNK_SIZE };
+    unsigned char *plain = (unsigned char *)malloc(AEAD_CHUNK_SIZE);
+    unsigned char *data = (unsigned char *)malloc(AEAD_CHUNK_SIZE);
+    unsigned char *reference = (unsigned char *)malloc(AEAD_CHUNK_SIZE);
+    unsigned char rawKey[AEAD_KEY_SIZE], nonce[AEAD_NONCE_SIZE], aad[29];
+    unsigned char tag[AEAD_TAG_SIZE], referenceTag[AEAD_TAG_SIZE];
+
+    if (plain == NULL || data == NULL || reference == NULL) {
+        check(0, "aead: out of memory", "-", 0);
+        free(plain);
+        free(data);
+        free(reference);
+        return;
+    }
+    for (size_t k = 0; k < aeadImplCount; k++) {
+        const AeadImpl *impl = &aeadImpls[k];
+        AeadKey key, referenceKey;
+
+        if (useAeadImpl(impl->name) != 0) {
+            printf("skip: %s (not supported by this CPU)\n", impl->name);
+            continue;
+        }
+        for (size_t v = 0; v < sizeof(aeadVectors) / sizeof(aeadVectors[0]); v++) {
+            const AeadVector *vector = &aeadVectors[v];
+            unsigned char vectorAad[64], expected[256], expectedTag[AEAD_TAG_SIZE];
+            size_t aadLen, len;
+
+            if (vector->cipher != impl->cipher) {
+                continue;
+            }
+            fromHex(vector->key, rawKey);
+            fromHex(vector->nonce, nonce);
+            aadLen = fromHex(vector->aad, vectorAad);
+            len = fromHex(vector->plain, data);
+            fromHex(vector->cipherText, expected);
+            fromHex(vector->tag, expectedTag);
+            aeadKeyInit(&key, impl->cipher, rawKey);
+            aeadSeal(&key, nonce, vectorAad, aadLen, data, len, tag);
+            check(memcmp(data, expected, len) == 0, vector->source, impl->name, len);
+            check(memcmp(tag, expectedTag, AEAD_TAG_SIZE) == 0, vector->source, impl->name, len);
+            check(aeadOpen(&key, nonce, vectorAad, aadLen, data, len, tag) == 0, "open", impl->name, len);
+            fromHex(vector->plain, expected);
+            check(memcmp(data, expected, len) == 0, "open plaintext", impl->name, len);
+        }
+
+        useAeadImpl(aeadPortableName(impl->cipher));
+        fillRandom(rawKey, sizeof(rawKey), k + 17);
+        aeadKeyInit(&referenceKey, impl->cipher, rawKey);
+        useAeadImpl(impl->name);
+        aeadKeyInit(&key, impl->cipher, rawKey);
+        for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+            size_t len = lengths[i];
+
+            fillRandom(plain, len, len + 23);
+            fillRandom(nonce, sizeof(nonce), len + 29);
+            fillRandom(aad, sizeof(aad), len + 31);
+            memcpy(reference, plain, len);
+            memcpy(data, plain, len);
+            aeadSeal(&referenceKey, nonce, aad, sizeof(aad), reference, len, referenceTag);
+            aeadSeal(&key, nonce, aad, sizeof(aad), data, len, tag);
+            check(memcmp(data, reference, len) == 0, "cipher text matches portable", impl->name, len);
+            check(memcmp(tag, referenceTag, AEAD_TAG_SIZE) == 0, "tag matches portable", impl->name, len);
+
+            tag[0] ^= 1;
+            check(aeadOpen(&key, nonce, aad, sizeof(aad), data, len, tag) != 0, "forged tag", impl->name, len);
+            tag[0] ^= 1;
+            if (len > 0) {
+                memcpy(data, reference, len);
+                data[len / 2] ^= 0x80;
+                check(aeadOpen(&key, nonce, aad, sizeof(aad), data, len, tag) != 0, "flipped bit",
+                      impl->name, len);
+            }
+            memcpy(data, reference, len);
+            check(aeadOpen(&key, nonce, aad, sizeof(aad), data, len, tag) == 0
+                  && memcmp(data, plain, len) == 0, "round trip", impl->name, len);
+        }
+        printf("ok: %s\n", impl->name);
+    }
+    free(plain);
+    free(data);
+    free(reference);
+}
+
+/*
+ * scrypt against RFC 7914 section 12 (the two cheaper vectors)
+ */
+static void testScrypt() {
+    unsigned char out[64], expected[64];
+
+    fromHex("77d6576238657b203b19ca42c18a0497f16b4844e3074ae8dfdffa3fede21442"
+            "fcd0069ded0948f8326a753a0fc81f17e8d3e0fb2e0d3628cf35e20c38d18906", expected);
+    check(scryptDerive((const unsigned char *)"", 0, (const unsigned char *)"", 0, 4, 1, 1, out, 64) == 0
+          && memcmp(out, expected, 64) == 0, "RFC 7914 N=16", "scrypt", 16);
+    fromHex("fdbabe1c9d3472007856e7190d01e9fe7c6ad7cbc8237830e77376634b373162"
+            "2eaf30d92e22a3886ff109279d9830dac727afb94a83ee6d8360cbdfa2cc0640", expected);
+    check(scryptDerive((const unsigned char *)"password", 8, (const unsigned char *)"NaCl", 4, 10, 8, 16,
+                       out, 64) == 0
+          && memcmp(out, expected, 64) == 0, "RFC 7914 N=1024", "scrypt", 1024);
+    printf("ok: scrypt\n");
+}
+
+/*
+ * BLAKE3 vectors: the input pattern of the official test_vectors.json
+ * (byte i is i % 251) and the first 32 bytes of each hash, over chunk and
+ * 64 KiB leaf boundaries
+ */
+static const struct {
+    size_t length;
+    const char *hash;
+} blake3Vectors[] = {
+    { 0, "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262" },
+    { 1, "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213" },
+    { 1023, "10108970eeda3eb932baac1428c7a2163b0e924c9a9e25b35bba72b28f70bd11" },
+    { 1024, "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7" },
+    { 1025, "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444" },
+    { 2048, "e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a" },
+    { 2049, "5f4d72f40d7a5f82b15ca2b2e44b1de3c2ef86c426c95c1af0b6879522563030" },
+    { 3072, "b98cb0ff3623be03326b373de6b9095218513e64f1ee2edd2525c7ad1e5cffd2" },
+    { 3073, "7124b49501012f81cc7f11ca069ec9226cecb8a2c850cfe644e327d22d3e1cd3" },
+    { 4096, "015094013f57a5277b59d8475c0501042c0b642e531b0a1c8f58d2163229e969" },
+    { 4097, "9b4052b38f1c5fc8b1f9ff7ac7b27cd242487b3d890d15c96a1c25b8aa0fb995" },
+    { 5120, "9cadc15fed8b5d854562b26a9536d9707cadeda9b143978f319ab34230535833" },
+    { 5121, "628bd2cb2004694adaab7bbd778a25df25c47b9d4155a55f8fbd79f2fe154cff" },
+    { 6144, "3e2e5b74e048f3add6d21faab3f83aa44d3b2278afb83b80b3c35164ebeca205" },
+    { 6145, "f1323a8631446cc50536a9f705ee5cb619424d46887f3c376c695b70e0f0507f" },
+    { 7168, "61da957ec2499a95d6b8023e2b0e604ec7f6b50e80a9678b89d2628e99ada77a" },
+    { 7169, "a003fc7a51754a9b3c7fae0367ab3d782dccf28855a03d435f8cfe74605e7817" },
+    { 8192, "aae792484c8efe4f19e2ca7d371d8c467ffb10748d8a5a1ae579948f718a2a63" },
+    { 8193, "bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b" },
+    { 16384, "f875d6646de28985646f34ee13be9a576fd515f76b5b0a26bb324735041ddde4" },
+    { 31744, "62b6960e1a44bcc1eb1a611a8d6235b6b4b78f32e7abc4fb4c6cdcce94895c47" },
+    { 102400, "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085" },
+    { 300000, "6cc9dce05d4cff8c5bef5c5a24681e42b13f03e34a0bc5e66f65a91d48c944fa" },
+};
+
+/*
+ * Every chunk hasher on the BLAKE3 vectors
+ */
+static void testBlake3() {
+    size_t maxLen = 300000;
+    unsigned char *input = (unsigned char *)malloc(maxLen);
+
+    if (input == NULL) {
+        check(0, "blake3: out of memory", "-", 0);
+        return;
+    }
+    for (size_t i = 0; i < maxLen; i++) {
+        input[i] = (unsigned char)(i % 251);
+    }
+    for (size_t k = 0; k < blake3ImplCount; k++) {
+        const char *name = blake3Impls[k].name;
+        if (useBlake3Impl(name) != 0) {
+            printf("skip: blake3 %s (not supported by this CPU)\n", name);
+            continue;
+        }
+        for (size_t v = 0; v < sizeof(blake3Vectors) / sizeof(blake3Vectors[0]); v++) {
+            unsigned char digest[BLAKE3_DIGEST_SIZE], expected[BLAKE3_DIGEST_SIZE];
+            fromHex(blake3Vectors[v].hash, expected);
+            blake3Hash(input, blake3Vectors[v].length, digest);
+            check(memcmp(digest, expected, BLAKE3_DIGEST_SIZE) == 0, "BLAKE3 vector", name,
+                  blake3Vectors[v].length);
+        }
+        printf("ok: blake3 %s\n", name);
+    }
+    free(input);
+}
+
+/*
+ * LZ4: a hand-assembled block from the block format description, then
+ * round trips of data that compresses well, not at all, and partly, with
+ * damaged blocks rejected
+ */
+static void testLz4() {
+    // Token 0x40: 4 literals "abcd", then a 4-byte match at offset 4;
+    // token 0x50: the 5 closing literals "efghi"
+    static const unsigned char block[] = { 0x40, 'a', 'b', 'c', 'd', 0x04, 0x00,
+                                           0x50, 'e', 'f', 'g', 'h', 'i' };
+    size_t size = AEAD_CHUNK_SIZE;
+    size_t capacity = size + size / 255 + 16;
+    unsigned char *plain = (unsigned char *)malloc(size);
+    unsigned char *packed = (unsigned char *)malloc(capacity);
+    unsigned char *unpacked = (unsigned char *)malloc(size);
+    unsigned char small[13];
+
+    if (plain == NULL || packed == NULL || unpacked == NULL) {
+        check(0, "lz4: out of memory", "-", 0);
+        free(plain);
+        free(packed);
+        free(unpacked);
+        return;
+    }
+    check(lz4DecompressBlock(block, sizeof(block), small, sizeof(small)) == 0
+          && memcmp(small, "abcdabcdefghi", sizeof(small)) == 0, "LZ4 reference block", "lz4", 0);
+    check(lz4DecompressBlock(block, sizeof(block), small, sizeof(small) - 1) != 0,
+          "LZ4 block of the wrong size", "lz4", 0);
+
+    for (int kind = 0; kind < 4; kind++) {
+        size_t packedLen;
+
+        for (size_t i = 0; i < size; i++) {
+            plain[i] = kind == 0 ? 0 : (unsigned char)("the quick brown fox "[i % 20]);
+        }
+        if (kind == 2) {
+            fillRandom(plain, size, 41);
+        } else if (kind == 3) {
+            fillRandom(plain + size / 3, size / 3, 43);
+        }
+        packedLen = lz4CompressBlock(plain, size, packed, capacity);
+        check(packedLen > 0, "LZ4 compress", "lz4", (size_t)kind);
+        check(kind == 2 || packedLen < size / 2, "LZ4 ratio", "lz4", (size_t)kind);
+        check(lz4DecompressBlock(packed, packedLen, unpacked, size) == 0
+              && memcmp(unpacked, plain, size) == 0, "LZ4 round trip", "lz4", (size_t)kind);
+        check(lz4DecompressBlock(packed, packedLen / 2, unpacked, size) != 0, "LZ4 truncated block",
+              "lz4", (size_t)kind);
+    }
+    printf("ok: lz4\n");
+    free(plain);
+    free(packed);
+    free(unpacked);
+}
+
+int main() {
+    testXor();
+    testAead();
+    testScrypt();
+    testBlake3();
+    testLz4();
+    if (failures > 0) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("all known-answer tests passed\n");
+    return 0;
+}
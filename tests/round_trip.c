@@ -0,0 +1,379 @@
+/*
+ * Round-trip tests for libfileencrypt
+ * Encrypts and decrypts files through the public API and compares the
+ * result with the input: XOR files in both stream modes, containers of
+ * each AEAD with and without LZ4, sparse input on eight threads,
+ * incremental updates and range reads of all of them. Damaged containers
+ * and wrong keys must be refused. Works in the current directory; exits
+ * with 1 if any check fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file_encrypt.h"
+
+#define PLAIN_FILE "round_trip.plain"
+#define ENCRYPTED_FILE "round_trip.enc"
+#define DAMAGED_FILE "round_trip.damaged"
+#define DECRYPTED_FILE "round_trip.dec"
+
+static int failures = 0;
+
+/*
+ * Record one check; prints the failing ones
+ */
+static void check(int ok, const char *what, const char *variant, size_t detail) {
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s (%s, %lu)\n", what, variant, (unsigned long)detail);
+        failures++;
+    }
+}
+
+/*
+ * Fill a buffer with cheap pseudo-random bytes
+ */
+static void fillRandom(unsigned char *data, size_t len, uint64_t seed) {
+    uint64_t x = seed | 1;
+    for (size_t i = 0; i < len; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        data[i] = (unsigned char)x;
+    }
+}
+
+/*
+ * Write a file; bytes of data that are zero are skipped over with a seek
+ * when sparse is set, which leaves holes where the file system has them
+ * Returns: 0 on success, -1 on failure
+ */
+static int writeFile(const char *path, const unsigned char *data, size_t len, int sparse) {
+    FILE *file = fopen(path, "wb");
+    size_t at = 0;
+    int result = 0;
+
+    if (file == NULL) {
+        return -1;
+    }
+    while (at < len && result == 0) {
+        size_t run = 1;
+        int zero = sparse && data[at] == 0;
+        while (at + run < len && (sparse && data[at + run] == 0) == zero) {
+            run++;
+        }
+        // The last byte is written even if zero, to give the file its size
+        if (zero && at + run < len) {
+            result = fseek(file, (long)run, SEEK_CUR);
+        } else if (fwrite(data + at, 1, run, file) != run) {
+            result = -1;
+        }
+        at += run;
+    }
+    if (fclose(file) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+/*
+ * Check whether a file holds exactly len bytes equal to data
+ */
+static int fileEquals(const char *path, const unsigned char *data, size_t len) {
+    FILE *file = fopen(path, "rb");
+    unsigned char buffer[65536];
+    size_t at = 0;
+    size_t got;
+    int same = 1;
+
+    if (file == NULL) {
+        return 0;
+    }
+    while (same && (got = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        same = at + got <= len && memcmp(buffer, data + at, got) == 0;
+        at += got;
+    }
+    fclose(file);
+    return same && at == len;
+}
+
+/*
+ * Check whether a file exists
+ */
+static int fileExists(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file != NULL) {
+        fclose(file);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Create a context; kdfCost is kept at its minimum to keep the tests fast
+ * Returns: The context, or NULL (counted as a failure)
+ */
+static FeContext *openContext(FeConfig *config, const char *key, const char *variant) {
+    FeContext *ctx = NULL;
+
+    config->kdfCost = 10;
+    config->overwrite = 1;
+    check(feContextCreate(config, key, &ctx) == FE_OK, "context", variant, 0);
+    return ctx;
+}
+
+/*
+ * Read ranges of ENCRYPTED_FILE and compare them with the plaintext: the
+ * first byte, ranges across chunk and segment boundaries, one that runs
+ * past the end and one that starts there
+ */
+static void checkRanges(FeContext *ctx, const unsigned char *plain, size_t len, const char *variant) {
+    static const size_t offsets[] = { 0, 1, 4095, 65535, 65536 * 3 - 7, 2 * 1024 * 1024 - 100 };
+    static const size_t lengths[] = { 1, 4097, 65536 + 2, 300000 };
+    unsigned char *out = (unsigned char *)malloc(300000);
+    size_t outLen;
+
+    if (out == NULL) {
+        check(0, "ranges: out of memory", variant, 0);
+        return;
+    }
+    for (size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+        for (size_t j = 0; j < sizeof(lengths) / sizeof(lengths[0]); j++) {
+            size_t offset = offsets[i] % len;
+            size_t expected = len - offset < lengths[j] ? len - offset : lengths[j];
+
+            check(feDecryptRange(ctx, ENCRYPTED_FILE, offset, lengths[j], out, &outLen) == FE_OK
+                  && outLen == expected && memcmp(out, plain + offset, expected) == 0,
+                  "range", variant, offset);
+        }
+    }
+    check(feDecryptRange(ctx, ENCRYPTED_FILE, len, 10, out, &outLen) == FE_OK && outLen == 0,
+          "range at the end", variant, len);
+    free(out);
+}
+
+/*
+ * Encrypt PLAIN_FILE, decrypt it again and read ranges of the result
+ */
+static void roundTrip(FeContext *ctx, const unsigned char *plain, size_t len, const char *variant) {
+    check(feEncryptFile(ctx, PLAIN_FILE, ENCRYPTED_FILE) == FE_OK, "encrypt", variant, len);
+    check(feDecryptFile(ctx, ENCRYPTED_FILE, DECRYPTED_FILE) == FE_OK, "decrypt", variant, len);
+    check(fileEquals(DECRYPTED_FILE, plain, len), "round trip", variant, len);
+    checkRanges(ctx, plain, len, variant);
+}
+
+/*
+ * XOR files in both stream modes, sequentially and on four threads;
+ * range reads of headerless XOR files once divided by zero
+ */
+static void testXor(const unsigned char *plain, size_t len) {
+    static const char *const variants[] = { "xor v1", "xor v2" };
+
+    check(writeFile(PLAIN_FILE, plain, len, 0) == 0, "write input", "xor", len);
+    for (int continuous = 0; continuous < 2; continuous++) {
+        for (int threads = 1; threads <= 4; threads += 3) {
+            FeConfig config;
+            FeContext *ctx;
+
+            feConfigInit(&config);
+            config.continuous = continuous;
+            config.threads = threads;
+            ctx = openContext(&config, "round trip key", variants[continuous]);
+            if (ctx != NULL) {
+                roundTrip(ctx, plain, len, variants[continuous]);
+                feContextDestroy(ctx);
+            }
+        }
+    }
+    printf("ok: xor\n");
+}
+
+/*
+ * Containers of each AEAD, with and without compression and a digest;
+ * damaged headers and a wrong key must be refused without an output. A
+ * context of the default xor cipher decrypts whatever is not a container
+ * as XOR ciphertext, so it must tell a damaged container apart.
+ */
+static void testContainers(const unsigned char *plain, size_t len) {
+    static const struct {
+        const char *cipher;
+        const char *compress;
+        int digest;
+    } variants[] = {
+        { "chacha20-poly1305", "none", 0 },
+        { "aes-256-gcm", "none", 1 },
+        { "chacha20-poly1305", "lz4", 1 },
+    };
+    FeConfig xorConfig;
+    FeContext *xorCtx;
+
+    feConfigInit(&xorConfig);
+    xorCtx = openContext(&xorConfig, "round trip key", "xor");
+    if (xorCtx == NULL) {
+        return;
+    }
+    check(writeFile(PLAIN_FILE, plain, len, 0) == 0, "write input", "container", len);
+    for (size_t i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+        const char *variant = variants[i].cipher;
+        unsigned char *damaged;
+        FeConfig config;
+        FeContext *ctx;
+        FeContext *wrongKey;
+        size_t outLen;
+        FILE *file;
+        long size;
+
+        feConfigInit(&config);
+        config.cipher = variants[i].cipher;
+        config.compress = variants[i].compress;
+        config.digest = variants[i].digest;
+        config.threads = 4;
+        ctx = openContext(&config, "round trip key", variant);
+        wrongKey = openContext(&config, "round trip kez", variant);
+        if (ctx == NULL || wrongKey == NULL) {
+            feContextDestroy(ctx);
+            feContextDestroy(wrongKey);
+            continue;
+        }
+        roundTrip(ctx, plain, len, variant);
+
+        remove(DECRYPTED_FILE);
+        check(feDecryptFile(wrongKey, ENCRYPTED_FILE, DECRYPTED_FILE) == FE_ERROR_AUTH
+              && !fileExists(DECRYPTED_FILE), "wrong key refused", variant, i);
+
+        // One flipped byte of the magic once sent a container down the XOR path
+        file = fopen(ENCRYPTED_FILE, "rb");
+        size = -1;
+        damaged = NULL;
+        if (file != NULL && fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) > 0
+            && (damaged = (unsigned char *)malloc((size_t)size)) != NULL) {
+            rewind(file);
+            if (fread(damaged, 1, (size_t)size, file) != (size_t)size) {
+                size = -1;
+            }
+        }
+        if (file != NULL) {
+            fclose(file);
+        }
+        check(damaged != NULL && size > 0, "read container", variant, i);
+        if (damaged != NULL && size > 0) {
+            damaged[3] ^= 0x20;
+            check(writeFile(DAMAGED_FILE, damaged, (size_t)size, 0) == 0, "write damaged", variant, i);
+            check(feDecryptFile(ctx, DAMAGED_FILE, DECRYPTED_FILE) != FE_OK
+                  && !fileExists(DECRYPTED_FILE), "damaged header refused", variant, i);
+            check(feDecryptFile(xorCtx, DAMAGED_FILE, DECRYPTED_FILE) == FE_ERROR_AUTH
+                  && !fileExists(DECRYPTED_FILE), "damaged header refused as XOR", variant, i);
+            check(feDecryptRange(xorCtx, DAMAGED_FILE, 0, 100, damaged, &outLen) == FE_ERROR_AUTH,
+                  "damaged header refused by a range read", variant, i);
+        }
+        free(damaged);
+        remove(DAMAGED_FILE);
+        feContextDestroy(ctx);
+        feContextDestroy(wrongKey);
+    }
+    feContextDestroy(xorCtx);
+    printf("ok: containers\n");
+}
+
+/*
+ * Sparse input on eight threads: holes that span several segments once
+ * left segments without records waiting for a turn that never came
+ */
+static void testHoles(const unsigned char *plain) {
+    size_t size = 24 * 1024 * 1024;
+    unsigned char *sparse = (unsigned char *)calloc(size, 1);
+    FeConfig config;
+    FeContext *ctx;
+
+    if (sparse == NULL) {
+        check(0, "holes: out of memory", "-", 0);
+        return;
+    }
+    // Data at the start, in the middle of the file and at its end, with
+    // holes of many segments between them
+    memcpy(sparse, plain, 1024 * 1024);
+    memcpy(sparse + 9 * 1024 * 1024 + 3, plain, 100000);
+    memcpy(sparse + size - 70000, plain, 70000);
+    check(writeFile(PLAIN_FILE, sparse, size, 1) == 0, "write sparse input", "holes", size);
+
+    feConfigInit(&config);
+    config.cipher = "chacha20-poly1305";
+    config.threads = 8;
+    ctx = openContext(&config, "round trip key", "holes");
+    if (ctx != NULL) {
+        roundTrip(ctx, sparse, size, "holes");
+        feContextDestroy(ctx);
+    }
+    free(sparse);
+    printf("ok: holes\n");
+}
+
+/*
+ * Incremental updates: change bytes in the middle, then append, then cut
+ * the file short, decrypting after each update
+ */
+static void testIncremental(const unsigned char *plain, size_t len) {
+    unsigned char *changed = (unsigned char *)malloc(len + 5000);
+    FeConfig config;
+    FeContext *ctx;
+
+    if (changed == NULL) {
+        check(0, "incremental: out of memory", "-", 0);
+        return;
+    }
+    feConfigInit(&config);
+    config.cipher = "aes-256-gcm";
+    config.incremental = 1;
+    config.threads = 4;
+    ctx = openContext(&config, "round trip key", "incremental");
+    if (ctx != NULL) {
+        remove(ENCRYPTED_FILE);
+        check(writeFile(PLAIN_FILE, plain, len, 0) == 0, "write input", "incremental", len);
+        roundTrip(ctx, plain, len, "incremental");
+
+        memcpy(changed, plain, len);
+        fillRandom(changed + len / 2, 1000, 51);
+        check(writeFile(PLAIN_FILE, changed, len, 0) == 0, "write input", "incremental", len);
+        roundTrip(ctx, changed, len, "incremental change");
+
+        fillRandom(changed + len, 5000, 53);
+        check(writeFile(PLAIN_FILE, changed, len + 5000, 0) == 0, "write input", "incremental", len);
+        roundTrip(ctx, changed, len + 5000, "incremental append");
+
+        check(writeFile(PLAIN_FILE, changed, len / 3, 0) == 0, "write input", "incremental", len);
+        roundTrip(ctx, changed, len / 3, "incremental truncate");
+        feContextDestroy(ctx);
+    }
+    free(changed);
+    printf("ok: incremental\n");
+}
+
+int main() {
+    size_t len = 3 * 1024 * 1024 + 12345;
+    unsigned char *plain = (unsigned char *)malloc(len);
+
+    if (plain == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    // Random data with a run of text, so LZ4 has something to compress
+    fillRandom(plain, len, 47);
+    for (size_t i = len / 4; i < len / 2; i++) {
+        plain[i] = (unsigned char)("the quick brown fox "[i % 20]);
+    }
+    testXor(plain, len);
+    testContainers(plain, len);
+    testHoles(plain);
+    testIncremental(plain, len);
+    free(plain);
+    remove(PLAIN_FILE);
+    remove(ENCRYPTED_FILE);
+    remove(DECRYPTED_FILE);
+    if (failures > 0) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("all round-trip tests passed\n");
+    return 0;
+}